@@ -0,0 +1,281 @@
+#!/usr/bin/env python
+
+"""Benchmark python-cdb and its C library; results go out as JSON lines.
+
+usage: bench.py [options] [dir]
+       bench.py --compare old.jsonl new.jsonl
+
+Builds benchmark/cdbbench.c against src/ and runs it over a matrix of
+record counts and key/value size distributions, then times the same
+work from Python (add against addmany and addfile, get, iteration)
+when the cdb module can be imported.  Scratch files go in dir
+(default: the current directory), which needs room for the largest
+file.
+
+Every line carries the settings it was measured under plus a "run"
+stamp, so results from different releases can be appended to one
+file and compared later with --compare.
+"""
+
+import json
+import optparse
+import os
+import platform
+import random
+import subprocess
+import sys
+import tempfile
+import time
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+TOP = os.path.dirname(HERE)
+SRC = os.path.join(TOP, 'src')
+LIBSRC = ['cdb.c', 'cdb_make.c', 'cdb_hash.c', 'uint32_pack.c',
+          'uint32_unpack.c', 'uint64_pack.c', 'uint64_unpack.c']
+
+# (records, mean key size, mean value size, distribution); files past
+# 4 GiB are written as cdb64
+MATRIX = {
+    'quick': [
+        (100000, 16, 100, 'fixed'),
+    ],
+    'default': [
+        (1000000, 8, 8, 'fixed'),
+        (1000000, 16, 100, 'fixed'),
+        (1000000, 32, 1000, 'uniform'),
+        (10000000, 16, 100, 'uniform'),
+    ],
+    'large': [
+        (100000000, 16, 100, 'uniform'),    # ~14 GB
+        (20000000, 32, 1000, 'uniform'),    # ~21 GB
+    ],
+}
+
+# fields that identify a measurement, as opposed to measuring it
+KEYS = ('layer', 'bench', 'records', 'key', 'value', 'dist', 'cdb64',
+        'wordhash', 'robinhood', 'expect', 'mmap', 'advice', 'cache', 'batch',
+        'threads')
+# the figure --compare reports for each kind of line, and whether
+# bigger is better
+METRIC = {
+  'add': ('records_per_s', True), 'addmany': ('records_per_s', True),
+  'addfile': ('records_per_s', True),
+  'finish': ('seconds', False), 'scan': ('records_per_s', True),
+  'hit': ('p50_ns', False), 'miss': ('p50_ns', False),
+  'findmany': ('mean_ns', False), 'get': ('p50_ns', False),
+  'getmany': ('mean_ns', False), 'iteritems': ('records_per_s', True),
+}
+
+
+def compile_cdbbench(cc, outdir):
+    exe = os.path.join(outdir, 'cdbbench')
+    cmd = cc.split() + ['-O2', '-D_FILE_OFFSET_BITS=64', '-I' + SRC,
+                        '-o', exe, os.path.join(HERE, 'cdbbench.c')]
+    cmd += [os.path.join(SRC, f) for f in LIBSRC] + ['-lpthread']
+    subprocess.check_call(cmd)
+    return exe
+
+
+def stamp():
+    run = {'run': time.strftime('%Y-%m-%dT%H:%M:%S'),
+           'host': platform.node(), 'machine': platform.machine()}
+    try:
+        run['git'] = subprocess.check_output(
+          ['git', 'describe', '--always', '--dirty'], cwd=TOP,
+          stderr=open(os.devnull, 'w')).strip()
+    except (OSError, subprocess.CalledProcessError):
+        pass
+    try:
+        import cdb
+        run['version'] = cdb.__version__
+    except ImportError:
+        pass
+    return run
+
+
+def emit(out, run, rec):
+    rec.update(run)
+    out.write(json.dumps(rec, sort_keys=True) + '\n')
+    out.flush()
+
+
+def run_c(exe, path, out, run, opts):
+    for records, ksize, vsize, dist in MATRIX[opts.size]:
+        cdb64 = records * (ksize + vsize + 8) >= 1 << 32
+        variants = [[]]
+        if opts.variants:
+            variants += [['-w'], ['-R'], ['-e'], ['-r'], ['-m'], ['-t', '0']]
+        for extra in variants:
+            args = [exe, '-n', str(records), '-k', str(ksize),
+                    '-v', str(vsize), '-d', dist, '-l', str(opts.lookups)] + extra
+            if cdb64:
+                args.append('-6')
+            proc = subprocess.Popen(args + [path], stdout=subprocess.PIPE)
+            for line in proc.stdout:
+                rec = json.loads(line)
+                rec['layer'] = 'c'
+                emit(out, run, rec)
+            if proc.wait():
+                raise SystemExit('%s failed' % ' '.join(args))
+
+
+def percentiles(ns):
+    ns.sort()
+    n = len(ns)
+    return dict(('p%s_ns' % p, ns[(n - 1) * pm // 1000])
+                for p, pm in (('50', 500), ('90', 900), ('99', 990),
+                              ('999', 999)))
+
+
+def run_python(path, out, run, opts):
+    try:
+        import cdb
+    except ImportError:
+        sys.stderr.write('bench.py: cdb not importable, skipping Python\n')
+        return
+
+    tmp = path + '.tmp'
+    clock = time.time
+    for records, ksize, vsize, dist in MATRIX[opts.size]:
+        if records > 1000000 and opts.size != 'large':
+            continue
+        base = {'layer': 'python', 'records': records, 'key': ksize,
+                'value': vsize, 'dist': dist}
+        rnd = random.Random(records)
+        if dist == 'fixed':
+            size = lambda mean, lo: max(mean, lo)
+        else:
+            size = lambda mean, lo: rnd.randint(lo, max(lo, 2 * mean - lo))
+        pairs = [('%08d' % i + 'k' * (size(ksize, 8) - 8),
+                  'v' * size(vsize, 0)) for i in xrange(records)]
+
+        cm = cdb.cdbmake(path, tmp)
+        t0 = clock()
+        for k, v in pairs:
+            cm.add(k, v)
+        t1 = clock()
+        cm.finish()
+        emit(out, run, dict(base, bench='add', seconds=t1 - t0,
+                            records_per_s=records / (t1 - t0)))
+
+        cm = cdb.cdbmake(path, tmp)
+        t0 = clock()
+        cm.addmany(pairs)
+        t1 = clock()
+        cm.finish()
+        t2 = clock()
+        emit(out, run, dict(base, bench='addmany', seconds=t1 - t0,
+                            records_per_s=records / (t1 - t0)))
+        emit(out, run, dict(base, bench='finish', seconds=t2 - t1, threads=1))
+
+        f = open(tmp + '.in', 'wb')
+        for k, v in pairs:
+            f.write('+%d,%d:%s->%s\n' % (len(k), len(v), k, v))
+        f.write('\n')
+        f.close()
+        cm = cdb.cdbmake(path, tmp)
+        t0 = clock()
+        cm.addfile(tmp + '.in')
+        t1 = clock()
+        cm.finish()
+        os.unlink(tmp + '.in')
+        emit(out, run, dict(base, bench='addfile', seconds=t1 - t0,
+                            records_per_s=records / (t1 - t0)))
+
+        c = cdb.init(path)
+        keys = [pairs[rnd.randrange(records)][0] for i in xrange(opts.lookups)]
+        ns = []
+        get = c.get
+        for k in keys:
+            t0 = clock()
+            get(k)
+            ns.append(int((clock() - t0) * 1e9))
+        emit(out, run, dict(base, bench='get', cache='warm', lookups=len(ns),
+                            mean_ns=sum(ns) / len(ns), **percentiles(ns)))
+
+        t0 = clock()
+        for i in xrange(0, len(keys), 32):
+            c.getmany(keys[i:i + 32])
+        t1 = clock()
+        emit(out, run, dict(base, bench='getmany', cache='warm', batch=32,
+                            lookups=len(keys),
+                            mean_ns=int((t1 - t0) * 1e9 / len(keys))))
+
+        t0 = clock()
+        for item in c.iteritems():
+            pass
+        t1 = clock()
+        emit(out, run, dict(base, bench='iteritems', cache='warm',
+                            seconds=t1 - t0,
+                            records_per_s=records / (t1 - t0)))
+        del c
+        os.unlink(path)
+
+
+def compare(old, new):
+    def load(fn):
+        r = {}
+        for line in open(fn):
+            rec = json.loads(line)
+            if rec.get('bench') in METRIC:
+                # a setting older runs lack was off; last run wins
+                r[tuple(rec.get(k) or None for k in KEYS)] = rec
+        return r
+
+    a, b = load(old), load(new)
+    for k in sorted(set(a) & set(b)):
+        metric, bigger = METRIC[a[k]['bench']]
+        x, y = a[k].get(metric), b[k].get(metric)
+        if not x or not y:
+            continue
+        ratio = float(y) / x
+        worse = ratio < 1 if bigger else ratio > 1
+        what = ' '.join('%s=%s' % (n, v) for n, v in zip(KEYS, k)
+                        if v is not None)
+        print '%-6s %8.3fx  %s %s: %s -> %s' % (
+          worse and 'slower' or 'faster', ratio, what, metric, x, y)
+
+
+def main():
+    p = optparse.OptionParser(usage=__doc__.split('\n\n')[1])
+    p.add_option('--size', choices=sorted(MATRIX), default='default',
+                 help='matrix of file sizes: quick, default or large')
+    p.add_option('--lookups', type='int', default=200000,
+                 help='timed lookups per phase')
+    p.add_option('--variants', action='store_true',
+                 help='also run wordhash, Robin Hood, size-hinted, '
+                      'MADV_RANDOM, pread and threaded-finish variants')
+    p.add_option('--no-c', dest='c', action='store_false', default=True)
+    p.add_option('--no-python', dest='python', action='store_false',
+                 default=True)
+    p.add_option('--cc', default=os.environ.get('CC', 'cc'))
+    p.add_option('-o', '--output', help='append results to this file')
+    p.add_option('--compare', action='store_true',
+                 help='compare two result files instead')
+    opts, args = p.parse_args()
+
+    if opts.compare:
+        if len(args) != 2:
+            p.error('--compare needs two files')
+        compare(*args)
+        return
+    if len(args) > 1:
+        p.error('too many arguments')
+
+    out = opts.output and open(opts.output, 'a') or sys.stdout
+    scratch = tempfile.mkdtemp(prefix='cdbbench.', dir=args and args[0] or '.')
+    path = os.path.join(scratch, 'bench.cdb')
+    run = stamp()
+    try:
+        if opts.c:
+            run_c(compile_cdbbench(opts.cc, scratch), path, out, run, opts)
+        if opts.python:
+            run_python(path, out, run, opts)
+    finally:
+        for f in os.listdir(scratch):
+            os.unlink(os.path.join(scratch, f))
+        os.rmdir(scratch)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,359 @@
+/* Public domain. */
+
+/*
+ * cdbbench: time the C library directly, without Python in the way.
+ *
+ *   cdbbench [options] file
+ *
+ *   -n records   records to write (default 1000000)
+ *   -k bytes     mean key size, at least 8 (default 16)
+ *   -v bytes     mean value size (default 100)
+ *   -d dist      size distribution: fixed or uniform (default fixed);
+ *                uniform sizes are spread evenly around the mean
+ *   -l lookups   timed lookups per phase (default 200000)
+ *   -b keys      keys per cdb_findmany() batch (default 32)
+ *   -t threads   cdb_make_finish() workers (default 1)
+ *   -6           write cdb64
+ *   -w           hash keys with cdb_hashw()
+ *   -R           place records in Robin Hood order
+ *   -e           tell cdb_make_expect() how many records are coming
+ *   -m           read with pread() instead of mmap()
+ *   -r           open with MADV_RANDOM
+ *   -x           keep the file afterwards
+ *
+ * Records are generated on the fly, so the file may be far larger than
+ * memory.  Each phase prints one JSON object per line on stdout.  The
+ * cold phases drop the file from the page cache first, which is only
+ * complete for pages nobody else has mapped.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "uint64.h"
+#include "cdb.h"
+#include "cdb_make.h"
+
+static uint64 records = 1000000;
+static unsigned int ksize = 16;
+static unsigned int vsize = 100;
+static int uniform = 0;
+static unsigned int lookups = 200000;
+static unsigned int batch = 32;
+static int threads = 1;
+static uint32 flags = 0;
+static int how = 0;
+static int expect = 0;
+static int keep = 0;
+static char *fn;
+
+static char *pool; /* value bytes; values are windows into it */
+static char config[512]; /* leading fields of every line of output */
+
+static void die(const char *what)
+{
+  fprintf(stderr,"cdbbench: %s: %s\n",what,errno ? strerror(errno) : "failed");
+  if (fn && !keep) unlink(fn);
+  exit(111);
+}
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64 mix(uint64 x)
+{
+  x += 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+static unsigned int size(uint64 i,unsigned int mean,unsigned int min,uint64 salt)
+{
+  if (!uniform || mean <= min) return mean < min ? min : mean;
+  return min + mix(i ^ salt) % (2 * (mean - min) + 1);
+}
+
+#define keylen(i) size((i),ksize,8,0x6b6579)
+#define datalen(i) size((i),vsize,0,0x646174)
+
+/* record i's key: its number, then filler; numbers >= records miss */
+static void key(char *buf,uint64 i,unsigned int len)
+{
+  unsigned int j;
+  uint64 r;
+
+  uint64_pack(buf,i);
+  for (j = 8,r = mix(i);j < len;++j,r >>= 8) {
+    if (!(j & 7)) r = mix(r + j);
+    buf[j] = 'a' + (r & 15);
+  }
+}
+
+#define data(i) (pool + ((i) & 4095))
+
+static void emit(const char *bench,const char *fmt,...)
+{
+  va_list ap;
+
+  printf("{\"bench\": \"%s\", %s",bench,config);
+  va_start(ap,fmt);
+  vprintf(fmt,ap);
+  va_end(ap);
+  printf("}\n");
+  fflush(stdout);
+}
+
+static int nscmp(const void *a,const void *b)
+{
+  uint32 x = *(const uint32 *) a;
+  uint32 y = *(const uint32 *) b;
+  return x < y ? -1 : x > y;
+}
+
+/* the per mille'th of n sorted latencies */
+#define pct(ns,n,pm) ((ns)[(uint64) ((n) - 1) * (pm) / 1000])
+
+static void build(void)
+{
+  struct cdb_make cm;
+  char *k;
+  uint64 i, bytes = 0;
+  unsigned int klen, dlen;
+  double t0, t1, t2;
+  int fd;
+
+  fd = open(fn,O_RDWR | O_CREAT | O_TRUNC,0666);
+  if (fd == -1) die("open");
+  if (cdb_make_start(&cm,fd,flags) == -1) die("cdb_make_start");
+  cm.threads = threads;
+  if (expect && (cdb_make_expect(&cm,records) == -1)) die("cdb_make_expect");
+
+  k = malloc(2 * ksize + 8);
+  if (!k) die("malloc");
+
+  t0 = now();
+  for (i = 0;i < records;++i) {
+    klen = keylen(i);
+    dlen = datalen(i);
+    key(k,i,klen);
+    if (cdb_make_add(&cm,k,klen,data(i),dlen) == -1) die("cdb_make_add");
+    bytes += klen + dlen;
+  }
+  t1 = now();
+  if (cdb_make_finish(&cm) == -1) die("cdb_make_finish");
+  t2 = now();
+  if (fsync(fd) == -1) die("fsync");
+  if (close(fd) == -1) die("close");
+  cdb_make_free(&cm);
+  free(k);
+
+  emit("add","\"seconds\": %.6f, \"records_per_s\": %.0f, \"mb_per_s\": %.2f, "
+       "\"bytes\": %llu",
+       t1 - t0,records / (t1 - t0),bytes / (t1 - t0) / 1e6,bytes);
+  emit("finish","\"seconds\": %.6f, \"threads\": %d",t2 - t1,threads);
+}
+
+static void dropcache(struct cdb *c,int fd)
+{
+  cdb_free(c);
+#ifdef POSIX_FADV_DONTNEED
+  posix_fadvise(fd,0,0,POSIX_FADV_DONTNEED);
+#endif
+  cdb_initmap(c,fd,how);
+}
+
+/* time n single lookups of random records, or of absent keys if miss */
+static void lookup(struct cdb *c,const char *bench,const char *cache,
+                   unsigned int n,int miss,uint64 seed)
+{
+  struct cdb_cursor k;
+  uint32 *ns;
+  char *kbuf;
+  unsigned int j, klen;
+  uint64 i;
+  double t0, t1, total = 0;
+  int r;
+
+  if (!n) return;
+  ns = malloc(n * sizeof *ns);
+  kbuf = malloc(2 * ksize + 8);
+  if (!ns || !kbuf) die("malloc");
+
+  for (j = 0;j < n;++j) {
+    i = mix(seed + j) % records;
+    if (miss) i += records;
+    klen = keylen(i);
+    key(kbuf,i,klen);
+    t0 = now();
+    r = cdb_find(c,&k,kbuf,klen);
+    t1 = now();
+    if (r == -1) die("cdb_find");
+    if (r == miss || (!miss && cdb_datalen(&k) != datalen(i))) {
+      errno = 0;
+      die(miss ? "found an absent key" : "lost a record");
+    }
+    ns[j] = (t1 - t0) * 1e9;
+    total += t1 - t0;
+  }
+
+  qsort(ns,n,sizeof *ns,nscmp);
+  emit(bench,"\"cache\": \"%s\", \"lookups\": %u, \"mean_ns\": %.0f, "
+       "\"p50_ns\": %u, \"p90_ns\": %u, \"p99_ns\": %u, \"p999_ns\": %u, "
+       "\"max_ns\": %u",
+       cache,n,total * 1e9 / n,
+       pct(ns,n,500),pct(ns,n,900),pct(ns,n,990),pct(ns,n,999),ns[n - 1]);
+  free(ns);
+  free(kbuf);
+}
+
+static void findmany(struct cdb *c,unsigned int n,uint64 seed)
+{
+  struct cdb_batch *b;
+  char *kbuf;
+  unsigned int j, m, klen;
+  uint64 i;
+  double t0, total = 0;
+
+  if (!n || !batch) return;
+  b = malloc(batch * sizeof *b);
+  kbuf = malloc(batch * (2 * ksize + 8));
+  if (!b || !kbuf) die("malloc");
+
+  for (j = 0;j < n;j += batch) {
+    for (m = 0;m < batch;++m) {
+      i = mix(seed + j + m) % records;
+      klen = keylen(i);
+      b[m].key = kbuf + m * (2 * ksize + 8);
+      b[m].len = klen;
+      key(b[m].key,i,klen);
+    }
+    t0 = now();
+    if (cdb_findmany(c,b,batch) == -1) die("cdb_findmany");
+    total += now() - t0;
+    for (m = 0;m < batch;++m)
+      if (b[m].found != 1) { errno = 0; die("lost a record"); }
+  }
+
+  n = (n + batch - 1) / batch * batch;
+  emit("findmany","\"cache\": \"warm\", \"lookups\": %u, \"batch\": %u, "
+       "\"mean_ns\": %.0f",n,batch,total * 1e9 / n);
+  free(b);
+  free(kbuf);
+}
+
+/* walk every record, as cdb_o.each() does */
+static void scan(struct cdb *c,const char *cache)
+{
+  char buf[16];
+  uint64 pos, eod, klen, dlen, n = 0;
+  unsigned int w = c->w;
+  double t0, t1;
+  volatile char sink;
+
+  t0 = now();
+  if (cdb_read(c,buf,w,0) == -1) die("cdb_read");
+  eod = cdb_unpackw(buf,w);
+  for (pos = cdb_hdrsize(c);pos < eod;pos += 2 * w + klen + dlen) {
+    if (cdb_read(c,buf,2 * w,pos) == -1) die("cdb_read");
+    klen = cdb_unpackw(buf,w);
+    dlen = cdb_unpackw(buf + w,w);
+    if (c->map) /* touch the record, as a reader would */
+      sink = c->map[pos + 2 * w + klen + dlen - 1];
+    ++n;
+  }
+  t1 = now();
+  (void) sink;
+  if (n != records) { errno = 0; die("scan miscounted"); }
+
+  emit("scan","\"cache\": \"%s\", \"seconds\": %.6f, \"records_per_s\": %.0f, "
+       "\"mb_per_s\": %.2f",
+       cache,t1 - t0,n / (t1 - t0),eod / (t1 - t0) / 1e6);
+}
+
+int main(int argc,char **argv)
+{
+  struct cdb c;
+  struct stat st;
+  uint64 warmed;
+  int opt, fd;
+  unsigned int j;
+
+  while ((opt = getopt(argc,argv,"n:k:v:d:l:b:t:6wRemrx")) != -1)
+    switch (opt) {
+      case 'n': records = strtoull(optarg,0,10); break;
+      case 'k': ksize = atoi(optarg); break;
+      case 'v': vsize = atoi(optarg); break;
+      case 'd':
+        if (!strcmp(optarg,"uniform")) uniform = 1;
+        else if (!strcmp(optarg,"fixed")) uniform = 0;
+        else goto USAGE;
+        break;
+      case 'l': lookups = atoi(optarg); break;
+      case 'b': batch = atoi(optarg); break;
+      case 't': threads = atoi(optarg); break;
+      case '6': flags |= CDB_F_64; break;
+      case 'w': flags |= CDB_F_WORDHASH; break;
+      case 'R': flags |= CDB_F_ROBINHOOD; break;
+      case 'e': expect = 1; break;
+      case 'm': how |= CDB_MAP_NONE; break;
+      case 'r': how |= CDB_MAP_RANDOM; break;
+      case 'x': keep = 1; break;
+      default: goto USAGE;
+    }
+  if (optind + 1 != argc || !records || ksize < 8) goto USAGE;
+  fn = argv[optind];
+  if (threads <= 0) threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+  pool = malloc(2 * vsize + 4096);
+  if (!pool) die("malloc");
+  for (j = 0;j < 2 * vsize + 4096;++j) pool[j] = mix(j);
+
+  snprintf(config,sizeof config,
+           "\"records\": %llu, \"key\": %u, \"value\": %u, \"dist\": \"%s\", "
+           "\"cdb64\": %d, \"wordhash\": %d, \"robinhood\": %d, "
+           "\"expect\": %d, \"mmap\": %d, \"advice\": \"%s\", ",
+           records,ksize,vsize,uniform ? "uniform" : "fixed",
+           !!(flags & CDB_F_64),!!(flags & CDB_F_WORDHASH),
+           !!(flags & CDB_F_ROBINHOOD),expect,
+           !(how & CDB_MAP_NONE),(how & CDB_MAP_RANDOM) ? "random" : "normal");
+
+  build();
+
+  fd = open(fn,O_RDONLY);
+  if (fd == -1 || fstat(fd,&st) == -1) die("open");
+  emit("file","\"bytes\": %llu",(uint64) st.st_size);
+
+  memset(&c,0,sizeof c);
+  dropcache(&c,fd);
+  lookup(&c,"hit","cold",lookups < 10000 ? lookups : 10000,0,1);
+  dropcache(&c,fd);
+  scan(&c,"cold");
+  scan(&c,"warm");
+  if (cdb_warm(&c,&warmed) == -1) die("cdb_warm");
+  lookup(&c,"hit","warm",lookups,0,2);
+  lookup(&c,"miss","warm",lookups,1,3);
+  findmany(&c,lookups,4);
+
+  cdb_free(&c);
+  close(fd);
+  if (!keep) unlink(fn);
+  return 0;
+
+  USAGE:
+  fprintf(stderr,"usage: cdbbench [-n records] [-k keysize] [-v valuesize] "
+          "[-d fixed|uniform] [-l lookups] [-b batch] [-t threads] "
+          "[-6wRmrx] file\n");
+  return 100;
+}
@@ -3,7 +3,8 @@
 SRCDIR   = "src"
 SRCFILES = map(lambda f: SRCDIR + '/' + f + '.c',
               ["cdbmodule","cdb","cdb_make","cdb_hash",
-               "uint32_pack","uint32_unpack"])
+               "uint32_pack","uint32_unpack",
+               "uint64_pack","uint64_unpack"])
 
 from distutils.core import setup, Extension
 
@@ -26,9 +27,12 @@ objects.''',
                             "cdb",
                             SRCFILES,
                             include_dirs=[ SRCDIR + '/' ],
+                            define_macros=[ ('_FILE_OFFSET_BITS', '64') ],
+                            libraries=[ 'pthread' ],
                             extra_compile_args=['-fPIC'],
                         )
                       ],
+        scripts = [ "scripts/cdbanalyze" ],
         url = "https://github.com/acg/python-cdb",
         classifiers=[
             'Programming Language :: Python',
@@ -1,67 +1,269 @@
 /* Public domain. */
 /* Adapted from DJB's original cdb-0.75 package */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* MAP_POPULATE, MADV_HUGEPAGE */
+#endif
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <string.h>
+#include <stdlib.h>
 #include <errno.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#endif
 #include "cdb.h"
 
 #ifndef EPROTO
 #define EPROTO -15  /* cdb 0.75's default for PROTOless systems */
 #endif
 
+#ifdef __GNUC__
+#define prefetch(p) __builtin_prefetch(p)
+#else
+#define prefetch(p)
+#endif
+
+uint64 cdb_unpackw(const char *buf,unsigned int w)
+{
+  uint32 u;
+  uint64 v;
+
+  if (w == 8) {
+    uint64_unpack(buf,&v);
+    return v;
+  }
+  uint32_unpack(buf,&u);
+  return u;
+}
+
 void cdb_free(struct cdb *c)
 {
+  if (!c->map) free(c->bloom);
+  c->bloom = 0;
   if (c->map) {
     munmap(c->map,c->size);
     c->map = 0;
   }
 }
 
-void cdb_findstart(struct cdb *c)
+void cdb_findstart(struct cdb_cursor *k)
 {
-  c->loop = 0;
+  k->loop = 0;
+  k->nomatch = 0;
 }
 
-void cdb_init(struct cdb *c,int fd)
+static void cdb_initbloom(struct cdb *c,uint64 pos,uint64 len)
+{
+  char buf[16];
+  uint32 k, pad;
+  uint64 n;
+
+  if (len < 16) return;
+  if (cdb_read(c,buf,16,pos) == -1) return;
+  uint32_unpack(buf,&k);
+  uint32_unpack(buf + 4,&pad);
+  uint64_unpack(buf + 8,&n);
+  if (!k || (k > CDB_BLOOMMAXK) || !n || (n > ((uint64) 1 << 32))) return;
+  if ((len - 16 < pad) || ((len - 16 - pad) / CDB_BLOOMBLOCK != n)) return;
+  pos += 16 + pad;
+
+  if (c->map)
+    c->bloom = c->map + pos;
+  else {
+    if (n * CDB_BLOOMBLOCK != (size_t) (n * CDB_BLOOMBLOCK)) return;
+    c->bloom = malloc(n * CDB_BLOOMBLOCK);
+    if (!c->bloom) return;
+    if (cdb_read(c,c->bloom,n * CDB_BLOOMBLOCK,pos) == -1) {
+      free(c->bloom);
+      c->bloom = 0;
+      return;
+    }
+  }
+  c->bloomblocks = n;
+  c->bloomk = k;
+}
+
+/* 0 if no key with hash h is in the file, 1 if one may be */
+static int cdb_bloomhas(struct cdb *c,uint32 h)
+{
+  unsigned int bit[CDB_BLOOMMAXK];
+  unsigned char *p;
+  unsigned int i;
+
+  p = (unsigned char *) c->bloom;
+  p += cdb_bloomprobe(h,c->bloomblocks,c->bloomk,bit) * CDB_BLOOMBLOCK;
+  for (i = 0;i < c->bloomk;++i)
+    if (!(p[bit[i] >> 3] & (1 << (bit[i] & 7)))) return 0;
+  return 1;
+}
+
+/*
+ * Look for a trailer and adopt its flags and sections.  The tail must
+ * be intact and the hash tables named by the header must end exactly
+ * where the trailer begins; anything else is treated as a classic cdb.
+ */
+static void cdb_inittombs(struct cdb *c,uint64 pos,uint64 len)
+{
+  char buf[8];
+  uint64 n;
+
+  if (cdb_read(c,buf,8,pos) == -1) return;
+  uint64_unpack(buf,&n);
+  if (n > (len - 8) / 16) return;
+  c->tombpos = pos;
+  c->ntombs = n;
+}
+
+static void cdb_inittail(struct cdb *c)
+{
+  char buf[4096];
+  uint64 len, end, u;
+  uint32 flags;
+  unsigned int w;
+  int i;
+
+  if (c->size < 2048 + CDB_TAILSIZE) return;
+  if (cdb_read(c,buf,CDB_TAILSIZE,c->size - CDB_TAILSIZE) == -1) return;
+  if (memcmp(buf + 16,CDB_TAILMAGIC,8)) return;
+  uint32_unpack(buf,&flags);
+  uint64_unpack(buf + 8,&len);
+  w = (flags & CDB_F_64) ? 8 : 4;
+  if ((len < CDB_TAILSIZE) || (len > c->size - (w << 9))) return;
+
+  if (cdb_read(c,buf,w << 9,0) == -1) return;
+  end = 0;
+  for (i = 0;i < 256;++i) {
+    u = cdb_unpackw(buf + 2 * w * i,w) + 2 * w * cdb_unpackw(buf + 2 * w * i + w,w);
+    if (u > end) end = u;
+  }
+  if (end != c->size - len) return;
+
+  c->w = w;
+  c->flags = flags;
+
+  for (u = end;u < c->size - CDB_TAILSIZE;u += CDB_SECTHEAD + len) {
+    if (c->size - CDB_TAILSIZE - u < CDB_SECTHEAD) return;
+    if (cdb_read(c,buf,CDB_SECTHEAD,u) == -1) return;
+    uint32_unpack(buf,&flags);
+    uint64_unpack(buf + 8,&len);
+    if (len > c->size - CDB_TAILSIZE - u - CDB_SECTHEAD) return;
+    if (flags == CDB_S_BLOOM) cdb_initbloom(c,u + CDB_SECTHEAD,len);
+    if ((flags == CDB_S_COUNTS) && (len == 2048)) c->countpos = u + CDB_SECTHEAD;
+    if ((flags == CDB_S_TOMBS) && (len >= 8)) cdb_inittombs(c,u + CDB_SECTHEAD,len);
+  }
+}
+
+/*
+ * cdb_initmap() is cdb_init() with a mapping policy: CDB_MAP_* flags.
+ * Advice the system does not support is skipped silently; only a
+ * failed CDB_MAP_LOCK is reported, by returning -1 with the map intact.
+ */
+int cdb_initmap(struct cdb *c,int fd,int how)
 {
   struct stat st;
   char *x;
+  int mflags = MAP_SHARED;
+  int r = 0;
 
   cdb_free(c);
-  cdb_findstart(c);
   c->fd = fd;
+  c->size = 0;
+  c->w = 4;
+  c->flags = 0;
+  c->how = how;
+  c->bloomblocks = 0;
+  c->bloomk = 0;
+  c->countpos = 0;
+  c->tombpos = 0;
+  c->ntombs = 0;
 
-  if (fstat(fd,&st) == 0)
-    if (st.st_size <= 0xffffffff) {
-      x = mmap(0,st.st_size,PROT_READ,MAP_SHARED,fd,0);
-      if (x + 1) {
-	c->size = st.st_size;
+#ifdef MAP_POPULATE
+  if (how & CDB_MAP_POPULATE) mflags |= MAP_POPULATE;
+#endif
+
+  if (fstat(fd,&st) == 0) {
+    c->size = st.st_size;
+    if (!(how & CDB_MAP_NONE) && (st.st_size == (size_t) st.st_size)) {
+      x = mmap(0,st.st_size,PROT_READ,mflags,fd,0);
+      if (x + 1)
 	c->map = x;
-      }
     }
+  }
+
+  if (c->map) {
+    if (how & CDB_MAP_RANDOM) madvise(c->map,c->size,MADV_RANDOM);
+    if (how & CDB_MAP_WILLNEED) madvise(c->map,c->size,MADV_WILLNEED);
+#ifdef MADV_HUGEPAGE
+    if (how & CDB_MAP_HUGEPAGE) madvise(c->map,c->size,MADV_HUGEPAGE);
+#endif
+  }
+
+  cdb_inittail(c);
+  if (c->map && (how & CDB_MAP_LOCK)) r = mlock(c->map,c->size);
+  return r;
+}
+
+void cdb_init(struct cdb *c,int fd)
+{
+  cdb_initmap(c,fd,0);
+}
+
+/*
+ * Fault in the hash tables, from the end of the records to the end of
+ * the file, leaving the records alone.  Returns the bytes covered.
+ */
+int cdb_warm(struct cdb *c,uint64 *warmed)
+{
+  char buf[8];
+  volatile char sink;
+  uint64 eod, pos, pg;
+
+  *warmed = 0;
+  if (cdb_read(c,buf,c->w,0) == -1) return -1;
+  eod = cdb_unpackw(buf,c->w);
+  if (eod > c->size) { errno = EPROTO; return -1; }
+
+  pg = sysconf(_SC_PAGESIZE);
+  pos = eod - eod % pg;
+
+  if (c->map) {
+    madvise(c->map + pos,c->size - pos,MADV_WILLNEED);
+    for (;pos < c->size;pos += pg)
+      sink = c->map[pos];
+    sink = c->map[c->size - 1];
+    (void) sink;
+  }
+#ifdef POSIX_FADV_WILLNEED
+  else
+    posix_fadvise(c->fd,pos,c->size - pos,POSIX_FADV_WILLNEED);
+#endif
+
+  *warmed = c->size - eod;
+  return 0;
 }
 
-int cdb_read(struct cdb *c,char *buf,unsigned int len,uint32 pos)
+int cdb_read(struct cdb *c,char *buf,unsigned int len,uint64 pos)
 {
   if (c->map) {
     if ((pos > c->size) || (c->size - pos < len)) goto FORMAT;
     memcpy(buf,c->map + pos,len);
   }
   else {
-    if (lseek(c->fd,pos,SEEK_SET) == -1) return -1;
-    /* if (seek_set(c->fd,pos) == -1) return -1; */
+    /* pread() leaves the shared file offset alone */
     while (len > 0) {
-      int r;
+      ssize_t r;
       do
-        r = read(c->fd,buf,len);
+        r = pread(c->fd,buf,len,pos);
       while ((r == -1) && (errno == EINTR));
       if (r == -1) return -1;
       if (r == 0) goto FORMAT;
       buf += r;
+      pos += r;
       len -= r;
     }
   }
@@ -72,11 +274,34 @@ int cdb_read(struct cdb *c,char *buf,unsigned int len,uint32 pos)
   return -1;
 }
 
-static int match(struct cdb *c,char *key,unsigned int len,uint32 pos)
+/*
+ * Compare in place against a key already known to lie inside the map.
+ * Most mismatches differ in the first eight bytes, which the compiler
+ * turns into a single load and compare; the rest goes to memcmp(),
+ * which libc vectorizes.
+ */
+static int matchmap(const char *p,const char *key,unsigned int len)
+{
+  if (len >= 8) {
+    if (memcmp(p,key,8)) return 0;
+    return !memcmp(p + 8,key + 8,len - 8);
+  }
+  return !memcmp(p,key,len);
+}
+
+static int match(struct cdb *c,char *key,unsigned int len,uint64 pos)
 {
   char buf[32];
   int n;
 
+  if (c->map) {
+    if ((pos > c->size) || (c->size - pos < len)) {
+      errno = EPROTO;
+      return -1;
+    }
+    return matchmap(c->map + pos,key,len);
+  }
+
   while (len > 0) {
     n = sizeof buf;
     if (n > len) n = len;
@@ -89,53 +314,785 @@ static int match(struct cdb *c,char *key,unsigned int len,uint32 pos)
   return 1;
 }
 
-int cdb_findnext(struct cdb *c,char *key,unsigned int len)
+/*
+ * In a CDB_F_ROBINHOOD file, probe runs are ordered by home slot, so
+ * once a search reaches a slot whose occupant h sits nearer its home
+ * than the search is to its own, the key cannot lie further on.
+ */
+static int robinhoodpast(struct cdb_cursor *k,uint32 h,uint64 slot)
 {
-  char buf[8];
-  uint32 pos;
-  uint32 u;
+  uint64 home = (h >> 8) % k->hslots;
+  return (slot + k->hslots - home) % k->hslots < k->loop;
+}
 
-  if (!c->loop) {
-    u = cdb_hash(key,len);
-    if (cdb_read(c,buf,8,(u << 3) & 2047) == -1) return -1;
-    uint32_unpack(buf + 4,&c->hslots);
-    if (!c->hslots) return 0;
-    uint32_unpack(buf,&c->hpos);
-    c->khash = u;
-    u >>= 8;
-    u %= c->hslots;
-    u <<= 3;
-    c->kpos = c->hpos + u;
-  }
-
-  while (c->loop < c->hslots) {
-    if (cdb_read(c,buf,8,c->kpos) == -1) return -1;
-    uint32_unpack(buf + 4,&pos);
+/* cdb_findnext() given h, the key's hash under c->flags */
+int cdb_findnexth(struct cdb *c,struct cdb_cursor *k,char *key,unsigned int len,uint32 h)
+{
+  char buf[16];
+  unsigned int w = c->w;
+  uint64 pos;
+  uint64 u;
+
+  if (!k->loop) {
+    k->khash = h;
+    if (c->bloom && !cdb_bloomhas(c,k->khash)) return 0;
+    if (cdb_read(c,buf,w + w,(k->khash & 255) * (w + w)) == -1) return -1;
+    k->hslots = cdb_unpackw(buf + w,w);
+    if (!k->hslots) return 0;
+    k->hpos = cdb_unpackw(buf,w);
+    u = k->khash >> 8;
+    u %= k->hslots;
+    k->kpos = k->hpos + u * (w + w);
+  }
+
+  while (k->loop < k->hslots) {
+    if (cdb_read(c,buf,w + w,k->kpos) == -1) return -1;
+    pos = cdb_unpackw(buf + w,w);
     if (!pos) return 0;
-    c->loop += 1;
-    c->kpos += 8;
-    if (c->kpos == c->hpos + (c->hslots << 3)) c->kpos = c->hpos;
-    uint32_unpack(buf,&u);
-    if (u == c->khash) {
-      if (cdb_read(c,buf,8,pos) == -1) return -1;
-      uint32_unpack(buf,&u);
+    u = cdb_unpackw(buf,w);
+    if ((c->flags & CDB_F_ROBINHOOD) && (u != k->khash))
+      if (robinhoodpast(k,u,(k->kpos - k->hpos) / (w + w))) return 0;
+    k->loop += 1;
+    k->kpos += w + w;
+    if (k->kpos == k->hpos + k->hslots * (w + w)) k->kpos = k->hpos;
+    if (u == k->khash) {
+      if (cdb_read(c,buf,w + w,pos) == -1) return -1;
+      u = cdb_unpackw(buf,w);
       if (u == len)
-	switch(match(c,key,len,pos + 8)) {
+	switch(match(c,key,len,pos + w + w)) {
 	  case -1:
 	    return -1;
 	  case 1:
-	    uint32_unpack(buf + 4,&c->dlen);
-	    c->dpos = pos + 8 + len;
+	    k->dlen = cdb_unpackw(buf + w,w);
+	    k->dpos = pos + w + w + len;
 	    return 1;
 	}
+      k->nomatch += 1;
+    }
+  }
+
+  return 0;
+}
+
+int cdb_findnext(struct cdb *c,struct cdb_cursor *k,char *key,unsigned int len)
+{
+  return cdb_findnexth(c,k,key,len,k->loop ? k->khash : cdb_hashf(c->flags,key,len));
+}
+
+int cdb_find(struct cdb *c,struct cdb_cursor *k,char *key,unsigned int len)
+{
+  cdb_findstart(k);
+  return cdb_findnext(c,k,key,len);
+}
+
+/* 1 if c has a CDB_S_TOMBS entry for key, whose hash under c->flags is h */
+int cdb_tombstoned(struct cdb *c,char *key,unsigned int len,uint32 h)
+{
+  char buf[16];
+  uint64 lo = 0, hi = c->ntombs, mid;
+  uint32 u;
+
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (cdb_read(c,buf,4,c->tombpos + 8 + 16 * mid) == -1) return -1;
+    uint32_unpack(buf,&u);
+    if (u < h) lo = mid + 1;
+    else hi = mid;
+  }
+
+  for (;lo < c->ntombs;++lo) {
+    if (cdb_read(c,buf,16,c->tombpos + 8 + 16 * lo) == -1) return -1;
+    uint32_unpack(buf,&u);
+    if (u != h) return 0;
+    uint32_unpack(buf + 4,&u);
+    if (u == len)
+      switch(match(c,key,len,c->tombpos + cdb_unpackw(buf + 8,8))) {
+	case -1: return -1;
+	case 1: return 1;
+      }
+  }
+  return 0;
+}
+
+/*
+ * Search a stack of n files, newest first, for key.  The first file
+ * holding a record under key, or a tombstone for it, decides, and
+ * *layer is set to its index (n if none does).  Returns 1 with k at
+ * that file's first record, so cdb_findnext() on c[*layer] goes on to
+ * the rest; 0 if the key is missing or deleted; -1 on error.  Each
+ * hash function is computed at most once, however deep the stack.
+ */
+int cdb_stackfind(struct cdb **c,unsigned int n,unsigned int *layer,struct cdb_cursor *k,char *key,unsigned int len)
+{
+  uint32 h[2];
+  int have[2] = { 0, 0 };
+  unsigned int i;
+  int j;
+  int r;
+
+  for (i = 0;i < n;++i) {
+    j = (c[i]->flags & CDB_F_WORDHASH) ? 1 : 0;
+    if (!have[j]) {
+      h[j] = j ? cdb_hashw(key,len) : cdb_hash(key,len);
+      have[j] = 1;
+    }
+    *layer = i;
+    cdb_findstart(k);
+    r = cdb_findnexth(c[i],k,key,len,h[j]);
+    if (r) return r;
+    if (c[i]->ntombs) {
+      r = cdb_tombstoned(c[i],key,len,h[j]);
+      if (r) return r == 1 ? 0 : -1;
     }
   }
 
+  *layer = n;
   return 0;
 }
 
-int cdb_find(struct cdb *c,char *key,unsigned int len)
+/*
+ * Search a sharded set of n files, all built with the same hash
+ * function, for key: only the file cdb_shard() picks can hold it.
+ * *shard is set to that file's index; otherwise as cdb_stackfind().
+ */
+int cdb_shardfind(struct cdb **c,unsigned int n,unsigned int *shard,struct cdb_cursor *k,char *key,unsigned int len)
 {
-  cdb_findstart(c);
-  return cdb_findnext(c,key,len);
+  uint32 h = cdb_hashf(c[0]->flags,key,len);
+
+  *shard = cdb_shard(h,n);
+  cdb_findstart(k);
+  return cdb_findnexth(c[*shard],k,key,len,h);
+}
+
+/*
+ * Number of records in each of the 256 tables, from the CDB_S_COUNTS
+ * section, or else from the header alone: at the classic load factor
+ * cdb_make_finish() gives every table twice as many slots as records.
+ */
+int cdb_counts(struct cdb *c,uint64 *counts)
+{
+  char buf[4096];
+  unsigned int w = c->w;
+  int i;
+
+  if (c->countpos) {
+    if (cdb_read(c,buf,2048,c->countpos) == -1) return -1;
+    for (i = 0;i < 256;++i)
+      uint64_unpack(buf + 8 * i,&counts[i]);
+    return 0;
+  }
+
+  if (cdb_read(c,buf,w << 9,0) == -1) return -1;
+  for (i = 0;i < 256;++i)
+    counts[i] = cdb_unpackw(buf + 2 * w * i + w,w) / 2;
+  return 0;
+}
+
+/*
+ * Batched lookup of the first record under each of n keys.
+ *
+ * On a mapped file the lookups advance in lock step: each round makes
+ * one memory access per unresolved key, and prefetches the location
+ * that key will need next round, so the cache misses of the whole
+ * batch overlap instead of following one another.
+ * Unmapped files fall back to cdb_find() key by key.
+ */
+
+#define BATCH_PROBE 0 /* next access: the slot at kpos */
+#define BATCH_RECORD 1 /* next access: the record header at rpos */
+
+int cdb_findmany(struct cdb *c,struct cdb_batch *b,unsigned int n)
+{
+  unsigned int w = c->w;
+  unsigned int i, m;
+  struct cdb_batch *x, **active;
+  const char *p;
+  uint64 u;
+
+  if (!c->map) {
+    for (i = 0;i < n;++i) {
+      b[i].found = cdb_find(c,&b[i].k,b[i].key,b[i].len);
+      if (b[i].found == -1) return -1;
+    }
+    return 0;
+  }
+
+  if (!n) return 0;
+  if (c->size < (w << 9)) goto FORMAT;
+
+  for (i = 0;i < n;++i) {
+    b[i].k.khash = cdb_hashf(c->flags,b[i].key,b[i].len);
+    if (c->bloom) {
+      u = cdb_bloomprobe(b[i].k.khash,c->bloomblocks,0,0);
+      prefetch(c->bloom + u * CDB_BLOOMBLOCK);
+    }
+    prefetch(c->map + (b[i].k.khash & 255) * (w + w));
+  }
+
+  active = (struct cdb_batch **) malloc(n * sizeof *active);
+  if (!active) return -1;
+
+  m = 0;
+  for (i = 0;i < n;++i) {
+    x = b + i;
+    p = c->map + (x->k.khash & 255) * (w + w);
+    x->found = 0;
+    x->k.loop = 0;
+    x->k.nomatch = 0;
+    if (c->bloom && !cdb_bloomhas(c,x->k.khash)) continue;
+    x->k.hslots = cdb_unpackw(p + w,w);
+    if (!x->k.hslots) continue;
+    x->k.hpos = cdb_unpackw(p,w);
+    if ((x->k.hpos > c->size) || ((c->size - x->k.hpos) / (w + w) < x->k.hslots)) goto FAIL;
+    x->k.kpos = x->k.hpos + ((x->k.khash >> 8) % x->k.hslots) * (w + w);
+    x->state = BATCH_PROBE;
+    prefetch(c->map + x->k.kpos);
+    active[m++] = x;
+  }
+
+  while (m) {
+    for (i = 0;i < m;) {
+      x = active[i];
+      if (x->state == BATCH_PROBE) {
+        if (x->k.loop == x->k.hslots) goto DONE;
+        p = c->map + x->k.kpos;
+        x->rpos = cdb_unpackw(p + w,w);
+        if (!x->rpos) goto DONE;
+        u = cdb_unpackw(p,w);
+        if ((c->flags & CDB_F_ROBINHOOD) && (u != x->k.khash))
+          if (robinhoodpast(&x->k,u,(x->k.kpos - x->k.hpos) / (w + w))) goto DONE;
+        x->k.loop += 1;
+        x->k.kpos += w + w;
+        if (x->k.kpos == x->k.hpos + x->k.hslots * (w + w)) x->k.kpos = x->k.hpos;
+        if (u == x->k.khash) {
+          if ((x->rpos > c->size) || (c->size - x->rpos < w + w)) goto FAIL;
+          x->state = BATCH_RECORD;
+          prefetch(c->map + x->rpos);
+        }
+        else
+          prefetch(c->map + x->k.kpos);
+      }
+      else {
+        p = c->map + x->rpos;
+        if (cdb_unpackw(p,w) == x->len) {
+          u = x->rpos + w + w;
+          if (c->size - u < x->len) goto FAIL;
+          if (matchmap(c->map + u,x->key,x->len)) {
+            x->k.dlen = cdb_unpackw(p + w,w);
+            x->k.dpos = u + x->len;
+            x->found = 1;
+            goto DONE;
+          }
+        }
+        x->k.nomatch += 1;
+        x->state = BATCH_PROBE;
+        prefetch(c->map + x->k.kpos);
+      }
+      ++i;
+      continue;
+
+      DONE:
+      active[i] = active[--m];
+    }
+  }
+
+  free(active);
+  return 0;
+
+  FAIL:
+  free(active);
+  FORMAT:
+  errno = EPROTO;
+  return -1;
+}
+
+/*
+ * Distinct-key iteration.  A record repeats an earlier key exactly when
+ * some record at a lower position has the same key; records sharing a
+ * key always share a hash, and so sit in the same table.  One pass over
+ * the hash tables, each sorted by (hash, position), therefore finds
+ * every repeat, and only runs of equal hashes need their keys read.
+ * Files whose tables hold no equal hashes are settled from the tables
+ * alone.  Memory is bounded by the largest table plus the repeats.
+ */
+
+struct cdb_slot { uint32 h; uint64 p; } ;
+
+static int slotcmp(const void *x,const void *y)
+{
+  const struct cdb_slot *a = x;
+  const struct cdb_slot *b = y;
+
+  if (a->h != b->h) return (a->h < b->h) ? -1 : 1;
+  if (a->p != b->p) return (a->p < b->p) ? -1 : 1;
+  return 0;
+}
+
+static int poscmp(const void *x,const void *y)
+{
+  uint64 a = *(const uint64 *) x;
+  uint64 b = *(const uint64 *) y;
+
+  return (a < b) ? -1 : (a > b);
+}
+
+/* do the records at a and b have the same key? */
+static int samekey(struct cdb *c,uint64 a,uint64 b)
+{
+  char x[32];
+  char y[32];
+  unsigned int w = c->w;
+  uint64 len;
+  unsigned int n;
+
+  if (cdb_read(c,x,w + w,a) == -1) return -1;
+  if (cdb_read(c,y,w + w,b) == -1) return -1;
+  len = cdb_unpackw(x,w);
+  if (len != cdb_unpackw(y,w)) return 0;
+  a += w + w;
+  b += w + w;
+
+  while (len > 0) {
+    n = sizeof x;
+    if (n > len) n = len;
+    if (cdb_read(c,x,n,a) == -1) return -1;
+    if (cdb_read(c,y,n,b) == -1) return -1;
+    if (memcmp(x,y,n)) return 0;
+    a += n;
+    b += n;
+    len -= n;
+  }
+  return 1;
+}
+
+/*
+ * Find the repeats among the n slots t of one table, sorted by
+ * slotcmp(): zero their positions and count them into *rlen, also
+ * appending the positions to *r unless r is 0.
+ */
+static int tablerepeats(struct cdb *c,struct cdb_slot *t,uint64 n,
+                        uint64 **r,uint64 *rlen,uint64 *rmax)
+{
+  uint64 u, v, j, k;
+  int x;
+
+  for (u = 0;u < n;u = v) {
+    for (v = u + 1;(v < n) && (t[v].h == t[u].h);++v) ;
+    /* t[u..v) share a hash; a record repeats if an earlier one
+       that is itself a first occurrence has its key */
+    for (j = u + 1;j < v;++j)
+      for (k = u;k < j;++k) {
+        if (!t[k].p) continue;
+        x = samekey(c,t[k].p,t[j].p);
+        if (x == -1) return -1;
+        if (!x) continue;
+        if (r) {
+          if (*rlen == *rmax) {
+            uint64 *nr;
+            *rmax = *rmax ? *rmax * 2 : 64;
+            nr = (uint64 *) realloc(*r,*rmax * sizeof *nr);
+            if (!nr) return -1;
+            *r = nr;
+          }
+          (*r)[*rlen] = t[j].p;
+        }
+        *rlen += 1;
+        t[j].p = 0;
+        break;
+      }
+  }
+  return 0;
+}
+
+int cdb_repeats(struct cdb *c,uint64 **out,uint64 *outlen)
+{
+  char hdr[4096];
+  char buf[4096];
+  unsigned int w = c->w;
+  struct cdb_slot *t = 0;
+  uint64 tmax = 0;
+  uint64 *r = 0;
+  uint64 rlen = 0;
+  uint64 rmax = 0;
+  uint64 hpos, hslots, n, u, j, m;
+  int i;
+
+  if (cdb_read(c,hdr,w << 9,0) == -1) return -1;
+
+  for (i = 0;i < 256;++i) {
+    hpos = cdb_unpackw(hdr + 2 * w * i,w);
+    hslots = cdb_unpackw(hdr + 2 * w * i + w,w);
+    if ((hpos > c->size) || ((c->size - hpos) / (w + w) < hslots)) goto FORMAT;
+    if (hslots > tmax) {
+      free(t);
+      t = (struct cdb_slot *) malloc(hslots * sizeof *t);
+      if (!t) goto FAIL;
+      tmax = hslots;
+    }
+
+    n = 0;
+    for (u = 0;u < hslots;u += m) {
+      m = hslots - u;
+      if (m > sizeof buf / (w + w)) m = sizeof buf / (w + w);
+      if (cdb_read(c,buf,m * (w + w),hpos + u * (w + w)) == -1) goto FAIL;
+      for (j = 0;j < m;++j) {
+        t[n].p = cdb_unpackw(buf + j * (w + w) + w,w);
+        if (!t[n].p) continue;
+        t[n].h = cdb_unpackw(buf + j * (w + w),w);
+        ++n;
+      }
+    }
+
+    qsort(t,n,sizeof *t,slotcmp);
+    if (tablerepeats(c,t,n,&r,&rlen,&rmax) == -1) goto FAIL;
+  }
+
+  free(t);
+  qsort(r,rlen,sizeof *r,poscmp);
+  *out = r;
+  *outlen = rlen;
+  return 0;
+
+  FORMAT:
+  errno = EPROTO;
+  FAIL:
+  free(t);
+  free(r);
+  return -1;
+}
+
+/*
+ * Survey a whole file: the bytes in records, keys, values, tables and
+ * trailer, and for each table its fill, repeats and the distance of
+ * every record from its home slot.  Everything is read front to back
+ * in ANALYZEBUF pieces, so the file need not fit in memory; the sort
+ * for repeats holds one table's occupied slots at a time.
+ */
+
+#define ANALYZEBUF (1 << 20)
+
+static int distadd(struct cdb_tablestat *ts,uint64 d)
+{
+  uint64 *nd;
+  uint64 n;
+
+  if (d >= ts->ndist) {
+    for (n = ts->ndist ? ts->ndist : 16;n <= d;n *= 2) ;
+    nd = (uint64 *) realloc(ts->dist,n * sizeof *nd);
+    if (!nd) return -1;
+    memset(nd + ts->ndist,0,(n - ts->ndist) * sizeof *nd);
+    ts->dist = nd;
+    ts->ndist = n;
+  }
+  ts->dist[d] += 1;
+  return 0;
+}
+
+void cdb_analyze_free(struct cdb_stat *st)
+{
+  int i;
+
+  for (i = 0;i < 256;++i) {
+    free(st->t[i].dist);
+    st->t[i].dist = 0;
+    st->t[i].ndist = 0;
+  }
+}
+
+int cdb_analyze(struct cdb *c,struct cdb_stat *st)
+{
+  char hdr[4096];
+  unsigned int w = c->w;
+  char *buf;
+  struct cdb_slot *t = 0;
+  struct cdb_tablestat *ts;
+  uint64 tmax = 0, rmax = 0;
+  uint64 eod, end, pos, boff, blen, klen, dlen, home, n, u, j, m;
+  int i;
+
+  memset(st,0,sizeof *st);
+  buf = malloc(ANALYZEBUF);
+  if (!buf) return -1;
+
+  if (cdb_read(c,hdr,w << 9,0) == -1) goto FAIL;
+  eod = cdb_unpackw(hdr,w);
+  if ((eod < (w << 9)) || (eod > c->size)) goto FORMAT;
+  st->hdrbytes = w << 9;
+
+  /* the records, one window at a time */
+  boff = blen = 0;
+  for (pos = w << 9;pos < eod;pos += w + w + klen + dlen) {
+    if ((pos < boff) || (pos + w + w > boff + blen)) {
+      blen = eod - pos;
+      if (blen > ANALYZEBUF) blen = ANALYZEBUF;
+      if (blen < w + w) goto FORMAT;
+      if (cdb_read(c,buf,blen,pos) == -1) goto FAIL;
+      boff = pos;
+    }
+    klen = cdb_unpackw(buf + (pos - boff),w);
+    dlen = cdb_unpackw(buf + (pos - boff) + w,w);
+    if (klen > eod - pos - w - w) goto FORMAT;
+    if (dlen > eod - pos - w - w - klen) goto FORMAT;
+    st->records += 1;
+    st->recbytes += w + w;
+    st->keybytes += klen;
+    st->databytes += dlen;
+  }
+
+  /* the tables, one at a time */
+  end = eod;
+  for (i = 0;i < 256;++i) {
+    ts = st->t + i;
+    ts->hpos = cdb_unpackw(hdr + 2 * w * i,w);
+    ts->hslots = cdb_unpackw(hdr + 2 * w * i + w,w);
+    if ((ts->hpos > c->size) || ((c->size - ts->hpos) / (w + w) < ts->hslots)) goto FORMAT;
+    if (ts->hpos + ts->hslots * (w + w) > end) end = ts->hpos + ts->hslots * (w + w);
+    st->tablebytes += ts->hslots * (w + w);
+
+    if (ts->hslots > tmax) {
+      free(t);
+      t = (struct cdb_slot *) malloc(ts->hslots * sizeof *t);
+      if (!t) goto FAIL;
+      tmax = ts->hslots;
+    }
+
+    n = 0;
+    for (u = 0;u < ts->hslots;u += m) {
+      m = ts->hslots - u;
+      if (m > ANALYZEBUF / (w + w)) m = ANALYZEBUF / (w + w);
+      if (cdb_read(c,buf,m * (w + w),ts->hpos + u * (w + w)) == -1) goto FAIL;
+      for (j = 0;j < m;++j) {
+        t[n].p = cdb_unpackw(buf + j * (w + w) + w,w);
+        if (!t[n].p) continue;
+        t[n].h = cdb_unpackw(buf + j * (w + w),w);
+        home = (t[n].h >> 8) % ts->hslots;
+        if (distadd(ts,(u + j + ts->hslots - home) % ts->hslots) == -1) goto FAIL;
+        ++n;
+      }
+    }
+    ts->records = n;
+
+    /* trim dist to the longest distance seen */
+    while (ts->ndist && !ts->dist[ts->ndist - 1]) --ts->ndist;
+
+    qsort(t,n,sizeof *t,slotcmp);
+    if (tablerepeats(c,t,n,0,&ts->repeats,&rmax) == -1) goto FAIL;
+  }
+  st->trailerbytes = c->size - end;
+
+  free(t);
+  free(buf);
+  return 0;
+
+  FORMAT:
+  errno = EPROTO;
+  FAIL:
+  free(t);
+  free(buf);
+  cdb_analyze_free(st);
+  return -1;
+}
+
+/*
+ * Dump the records, from the end of the header to the end of the
+ * data, to fd at its current offset.  CDB_DUMP_TEXT output is what
+ * cdbdump writes and cdbmake reads; it is assembled in DUMPBUF-byte
+ * pieces, straight from the map if there is one.  CDB_DUMP_RAW
+ * output is the records as stored, length pairs and all, and is
+ * copied within the kernel where the system allows.
+ */
+
+#define DUMPBUF (1 << 20)
+
+static int writeall(int fd,const char *buf,uint64 len)
+{
+  ssize_t r;
+
+  while (len > 0) {
+    r = write(fd,buf,len > DUMPBUF ? DUMPBUF : len);
+    if (r == -1) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    buf += r;
+    len -= r;
+  }
+  return 0;
+}
+
+static int dumpraw(struct cdb *c,int fd,uint64 pos,uint64 end)
+{
+  char *buf;
+  uint64 n;
+  ssize_t r = 0;
+#ifdef __linux__
+  loff_t off;
+#endif
+
+  /* each of these stops at the first failure, leaving the rest to
+     the next; a real I/O error recurs in the plain copy */
+#ifdef SYS_copy_file_range
+  while (pos < end) {
+    off = pos;
+    n = end - pos;
+    if (n > 1 << 30) n = 1 << 30;
+    r = syscall(SYS_copy_file_range,c->fd,&off,fd,0,(size_t) n,0);
+    if ((r == -1) && (errno == EINTR)) continue;
+    if (r <= 0) break;
+    pos += r;
+  }
+#endif
+#ifdef __linux__
+  while (pos < end) {
+    off = pos;
+    n = end - pos;
+    if (n > 1 << 30) n = 1 << 30;
+    r = sendfile(fd,c->fd,&off,(size_t) n);
+    if ((r == -1) && (errno == EINTR)) continue;
+    if (r <= 0) break;
+    pos += r;
+  }
+#endif
+
+  if (pos >= end) return 0;
+  if (c->map) {
+    if (end > c->size) { errno = EPROTO; return -1; }
+    return writeall(fd,c->map + pos,end - pos);
+  }
+
+  buf = malloc(DUMPBUF);
+  if (!buf) return -1;
+  for (;pos < end;pos += n) {
+    n = end - pos;
+    if (n > DUMPBUF) n = DUMPBUF;
+    if ((cdb_read(c,buf,n,pos) == -1) || (writeall(fd,buf,n) == -1)) {
+      free(buf);
+      return -1;
+    }
+  }
+  free(buf);
+  return 0;
+}
+
+struct cdb_dumper {
+  struct cdb *c;
+  char *in; /* the file's bytes from inoff, inlen of them */
+  uint64 inoff;
+  uint64 inlen;
+  char *inbuf; /* 0 if in is the map */
+  int fd;
+  char *out;
+  unsigned int outlen;
+} ;
+
+/* make the file's bytes [pos, pos + n) available in in; n <= DUMPBUF */
+static int dumpin(struct cdb_dumper *d,uint64 pos,uint64 n,uint64 end)
+{
+  if ((pos >= d->inoff) && (pos - d->inoff + n <= d->inlen)) return 0;
+  if (!d->inbuf || (end - pos < n)) { errno = EPROTO; return -1; }
+  d->inlen = end - pos;
+  if (d->inlen > DUMPBUF) d->inlen = DUMPBUF;
+  if (cdb_read(d->c,d->inbuf,d->inlen,pos) == -1) return -1;
+  d->inoff = pos;
+  return 0;
+}
+
+static int dumpout(struct cdb_dumper *d,const char *buf,uint64 len)
+{
+  if (len > DUMPBUF - d->outlen) {
+    if (writeall(d->fd,d->out,d->outlen) == -1) return -1;
+    d->outlen = 0;
+    if (len >= DUMPBUF) return writeall(d->fd,buf,len);
+  }
+  memcpy(d->out + d->outlen,buf,len);
+  d->outlen += len;
+  return 0;
+}
+
+static int dumpcopy(struct cdb_dumper *d,uint64 pos,uint64 len,uint64 end)
+{
+  uint64 n;
+
+  for (;len > 0;len -= n) {
+    n = len > DUMPBUF ? DUMPBUF : len;
+    if (dumpin(d,pos,n,end) == -1) return -1;
+    if (dumpout(d,d->in + (pos - d->inoff),n) == -1) return -1;
+    pos += n;
+  }
+  return 0;
+}
+
+static unsigned int fmtnum(char *s,uint64 u)
+{
+  char tmp[20];
+  unsigned int n = 0, i;
+
+  do tmp[n++] = '0' + u % 10; while (u /= 10);
+  for (i = 0;i < n;++i) s[i] = tmp[n - 1 - i];
+  return n;
+}
+
+int cdb_dump(struct cdb *c,int fd,int format)
+{
+  struct cdb_dumper d;
+  char hdr[48];
+  unsigned int w = c->w;
+  unsigned int n;
+  uint64 eod, pos, klen, dlen;
+
+  if (cdb_read(c,hdr,w,0) == -1) return -1;
+  eod = cdb_unpackw(hdr,w);
+  if ((eod < (w << 9)) || (eod > c->size)) { errno = EPROTO; return -1; }
+
+  if (format == CDB_DUMP_RAW)
+    return dumpraw(c,fd,w << 9,eod);
+  if (format != CDB_DUMP_TEXT) { errno = EINVAL; return -1; }
+
+  d.c = c;
+  d.fd = fd;
+  d.outlen = 0;
+  d.inbuf = 0;
+  d.inoff = 0;
+  d.inlen = eod;
+  d.in = c->map;
+  if (!c->map) {
+    d.in = d.inbuf = malloc(DUMPBUF);
+    if (!d.inbuf) return -1;
+    d.inlen = 0;
+  }
+  d.out = malloc(DUMPBUF);
+  if (!d.out) goto FAIL;
+
+  for (pos = w << 9;pos < eod;pos += w + w + klen + dlen) {
+    if (dumpin(&d,pos,w + w,eod) == -1) goto FAIL;
+    klen = cdb_unpackw(d.in + (pos - d.inoff),w);
+    dlen = cdb_unpackw(d.in + (pos - d.inoff) + w,w);
+    if (klen > eod - pos - w - w) goto FORMAT;
+    if (dlen > eod - pos - w - w - klen) goto FORMAT;
+
+    n = 0;
+    hdr[n++] = '+';
+    n += fmtnum(hdr + n,klen);
+    hdr[n++] = ',';
+    n += fmtnum(hdr + n,dlen);
+    hdr[n++] = ':';
+    if (dumpout(&d,hdr,n) == -1) goto FAIL;
+    if (dumpcopy(&d,pos + w + w,klen,eod) == -1) goto FAIL;
+    if (dumpout(&d,"->",2) == -1) goto FAIL;
+    if (dumpcopy(&d,pos + w + w + klen,dlen,eod) == -1) goto FAIL;
+    if (dumpout(&d,"\n",1) == -1) goto FAIL;
+  }
+  if (dumpout(&d,"\n",1) == -1) goto FAIL;
+  if (writeall(fd,d.out,d.outlen) == -1) goto FAIL;
+
+  free(d.inbuf);
+  free(d.out);
+  return 0;
+
+  FORMAT:
+  errno = EPROTO;
+  FAIL:
+  free(d.inbuf);
+  free(d.out);
+  return -1;
 }
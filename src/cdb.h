@@ -5,34 +5,183 @@
 #define CDB_H
 
 #include "uint32.h"
+#include "uint64.h"
 
 #define CDB_HASHSTART 5381
 extern uint32 cdb_hashadd(uint32,unsigned char);
 extern uint32 cdb_hash(char *,unsigned int);
+extern uint32 cdb_hashw(char *,unsigned int);
+extern uint64 cdb_bloomprobe(uint32,uint64,unsigned int,unsigned int *);
 
+/*
+ * Files may end in an optional trailer, placed after the last hash
+ * table where classic cdb readers never look:
+ *
+ *   ... tables ... | sections ... | tail
+ *
+ * The tail is CDB_TAILSIZE bytes: uint32 flags, uint32 0, uint64
+ * length of the whole trailer (tail included), CDB_TAILMAGIC.
+ * Classic 32-bit files without any CDB_F_* feature or section carry
+ * no trailer.
+ *
+ * Each section is a CDB_SECTHEAD byte head, uint32 type, uint32 0,
+ * uint64 length of the body, followed by the body.  Readers skip
+ * sections of types they do not know.
+ */
+#define CDB_TAILMAGIC "pycdb\0\0\1"
+#define CDB_TAILSIZE 24
+#define CDB_SECTHEAD 16
+
+/*
+ * CDB_S_BLOOM: a blocked Bloom filter over the key hashes.  The body
+ * is uint32 k, uint32 pad, uint64 nblocks, pad zero bytes, then
+ * nblocks blocks of CDB_BLOOMBLOCK bytes, the padding aligning them
+ * in the file.  A key sets, and a lookup tests, the k bits that
+ * cdb_bloomprobe() picks from one block: a miss costs a single
+ * cache line instead of a header and slot read.
+ */
+#define CDB_S_BLOOM 1
+#define CDB_BLOOMBLOCK 64
+#define CDB_BLOOMMAXK 16
+
+/*
+ * CDB_S_COUNTS: 256 uint64 record counts, one per table.  Files built
+ * at the classic load factor of 1/2 leave it out, as every table has
+ * twice as many slots as records.
+ */
+#define CDB_S_COUNTS 2
+
+/*
+ * CDB_S_TOMBS: keys a file deletes from the files beneath it in a
+ * stack (see cdb_stackfind()).  The body is uint64 n, then n entries
+ * of uint32 hash, uint32 key length and uint64 key offset from the
+ * start of the body, sorted by hash, then the keys.  The hash is the
+ * one the file's own records use.
+ */
+#define CDB_S_TOMBS 3
+
+#define CDB_F_64 0x1 /* cdb64: positions and lengths are 8 bytes wide */
+#define CDB_F_WORDHASH 0x2 /* keys hashed with cdb_hashw(), not cdb_hash() */
+#define CDB_F_ROBINHOOD 0x4 /* slots in Robin Hood order; see cdb_findnext() */
+
+/* the hash function a file with the given flags is built with */
+#define cdb_hashf(f,key,len) \
+  (((f) & CDB_F_WORDHASH) ? cdb_hashw((key),(len)) : cdb_hash((key),(len)))
+
+/*
+ * The shard of n that a key with hash h goes to in a sharded set.
+ * The multiply mixes the high bits in, so the choice does not follow
+ * the low byte each shard picks its table by, and the scaling to
+ * [0,n) needs no division.
+ */
+#define cdb_shard(h,n) \
+  ((unsigned int) (((uint64) (uint32) ((uint32) (h) * 0x9e3779b1UL) * (n)) >> 32))
+
+/*
+ * struct cdb is left alone after cdb_init(), so any number of threads
+ * may search one file at once, each with a struct cdb_cursor of its own.
+ * Zero it before its first cdb_init().
+ */
 struct cdb {
   char *map; /* 0 if no map is available */
   int fd;
-  uint32 size; /* initialized if map is nonzero */
-  uint32 loop; /* number of hash slots searched under this key */
+  uint64 size; /* size of the file, as of cdb_init() */
+  unsigned int w; /* width of positions and lengths: 4, or 8 for cdb64 */
+  uint32 flags; /* CDB_F_* from the trailer, 0 if there is none */
+  int how; /* CDB_MAP_* policy given to cdb_initmap() */
+  char *bloom; /* CDB_S_BLOOM blocks, 0 if none; a copy if not mapped */
+  uint64 bloomblocks;
+  unsigned int bloomk;
+  uint64 countpos; /* CDB_S_COUNTS body, 0 if none */
+  uint64 tombpos; /* CDB_S_TOMBS body, 0 if none */
+  uint64 ntombs;
+} ;
+
+#define CDB_MAP_NONE 0x1 /* do not mmap(); read with pread() */
+#define CDB_MAP_POPULATE 0x2 /* MAP_POPULATE: fault the file in up front */
+#define CDB_MAP_RANDOM 0x4 /* MADV_RANDOM: no readahead */
+#define CDB_MAP_WILLNEED 0x8 /* MADV_WILLNEED: start reading it all in */
+#define CDB_MAP_HUGEPAGE 0x10 /* MADV_HUGEPAGE */
+#define CDB_MAP_LOCK 0x20 /* mlock() the whole file */
+
+struct cdb_cursor {
+  uint64 loop; /* number of hash slots searched under this key */
   uint32 khash; /* initialized if loop is nonzero */
-  uint32 kpos; /* initialized if loop is nonzero */
-  uint32 hpos; /* initialized if loop is nonzero */
-  uint32 hslots; /* initialized if loop is nonzero */
-  uint32 dpos; /* initialized if cdb_findnext() returns 1 */
-  uint32 dlen; /* initialized if cdb_findnext() returns 1 */
+  uint64 kpos; /* initialized if loop is nonzero */
+  uint64 hpos; /* initialized if loop is nonzero */
+  uint64 hslots; /* initialized if loop is nonzero */
+  uint64 dpos; /* initialized if cdb_findnext() returns 1 */
+  uint64 dlen; /* initialized if cdb_findnext() returns 1 */
+  uint64 nomatch; /* records whose hash matched but whose key did not */
 } ;
 
+/* 256 (position, slots) pairs: 2048 bytes, or 4096 for cdb64 */
+#define cdb_hdrsize(c) ((c)->w << 9)
+
+extern uint64 cdb_unpackw(const char *,unsigned int);
+
 extern void cdb_free(struct cdb *);
 extern void cdb_init(struct cdb *,int fd);
+extern int cdb_initmap(struct cdb *,int fd,int);
+extern int cdb_warm(struct cdb *,uint64 *);
+
+extern int cdb_read(struct cdb *,char *,unsigned int,uint64);
+
+extern void cdb_findstart(struct cdb_cursor *);
+extern int cdb_findnext(struct cdb *,struct cdb_cursor *,char *,unsigned int);
+extern int cdb_findnexth(struct cdb *,struct cdb_cursor *,char *,unsigned int,uint32);
+extern int cdb_find(struct cdb *,struct cdb_cursor *,char *,unsigned int);
+
+extern int cdb_tombstoned(struct cdb *,char *,unsigned int,uint32);
+extern int cdb_stackfind(struct cdb **,unsigned int,unsigned int *,struct cdb_cursor *,char *,unsigned int);
+extern int cdb_shardfind(struct cdb **,unsigned int,unsigned int *,struct cdb_cursor *,char *,unsigned int);
+
+/* one key of a cdb_findmany() batch */
+struct cdb_batch {
+  char *key;
+  unsigned int len;
+  int state; /* private to cdb_findmany() */
+  uint64 rpos; /* record under comparison */
+  struct cdb_cursor k; /* dpos and dlen initialized if found is 1 */
+  int found;
+} ;
+
+extern int cdb_findmany(struct cdb *,struct cdb_batch *,unsigned int);
+
+extern int cdb_counts(struct cdb *,uint64 *);
+
+extern int cdb_repeats(struct cdb *,uint64 **,uint64 *);
+
+/* one hash table, as cdb_analyze() finds it */
+struct cdb_tablestat {
+  uint64 hpos;
+  uint64 hslots;
+  uint64 records; /* occupied slots */
+  uint64 repeats; /* records whose key an earlier record has */
+  uint64 *dist; /* dist[d]: records d slots past their home slot */
+  uint64 ndist; /* entries in dist: the longest distance plus one */
+} ;
+
+struct cdb_stat {
+  uint64 records;
+  uint64 hdrbytes; /* the 256-entry header */
+  uint64 recbytes; /* the length pairs in front of each record */
+  uint64 keybytes;
+  uint64 databytes;
+  uint64 tablebytes;
+  uint64 trailerbytes; /* anything after the last table */
+  struct cdb_tablestat t[256];
+} ;
+
+extern int cdb_analyze(struct cdb *,struct cdb_stat *);
+extern void cdb_analyze_free(struct cdb_stat *);
 
-extern int cdb_read(struct cdb *,char *,unsigned int,uint32);
+#define CDB_DUMP_TEXT 0 /* cdbdump(1) output: +klen,dlen:key->data lines */
+#define CDB_DUMP_RAW 1 /* the records exactly as stored */
 
-extern void cdb_findstart(struct cdb *);
-extern int cdb_findnext(struct cdb *,char *,unsigned int);
-extern int cdb_find(struct cdb *,char *,unsigned int);
+extern int cdb_dump(struct cdb *,int,int);
 
-#define cdb_datapos(c) ((c)->dpos)
-#define cdb_datalen(c) ((c)->dlen)
+#define cdb_datapos(k) ((k)->dpos)
+#define cdb_datalen(k) ((k)->dlen)
 
 #endif
@@ -20,3 +20,89 @@ uint32 cdb_hash(char *buf,unsigned int len)
   }
   return h;
 }
+
+/*
+ * Alternative hash for files flagged CDB_F_WORDHASH.  Takes the key
+ * eight bytes at a time in two independent lanes, then applies the
+ * murmur3 finalizer so that the low byte (the table) and the bits
+ * above it (the slot) are both well mixed.
+ */
+
+#define K1 0x9e3779b97f4a7c15ULL
+#define K2 0xc2b2ae3d27d4eb4fULL
+
+static uint64 load64(const unsigned char *p)
+{
+  return (uint64) p[0] | ((uint64) p[1] << 8) | ((uint64) p[2] << 16) |
+         ((uint64) p[3] << 24) | ((uint64) p[4] << 32) |
+         ((uint64) p[5] << 40) | ((uint64) p[6] << 48) |
+         ((uint64) p[7] << 56);
+}
+
+uint32 cdb_hashw(char *buf,unsigned int len)
+{
+  const unsigned char *p = (const unsigned char *) buf;
+  uint64 a, b, v;
+  unsigned int i;
+
+  a = CDB_HASHSTART ^ ((uint64) len * K1);
+  b = ~a;
+
+  while (len >= 16) {
+    a = (a ^ load64(p)) * K1;
+    b = (b ^ load64(p + 8)) * K2;
+    a ^= a >> 32;
+    b ^= b >> 29;
+    p += 16;
+    len -= 16;
+  }
+  if (len >= 8) {
+    a = (a ^ load64(p)) * K1;
+    a ^= a >> 32;
+    p += 8;
+    len -= 8;
+  }
+  v = 0;
+  for (i = 0;i < len;++i)
+    v |= (uint64) p[i] << (8 * i);
+  b = (b ^ v) * K2;
+
+  a ^= (b << 31) | (b >> 33);
+  a ^= a >> 33;
+  a *= 0xff51afd7ed558ccdULL;
+  a ^= a >> 33;
+  a *= 0xc4ceb9fe1a85ec53ULL;
+  a ^= a >> 33;
+  return (uint32) a;
+}
+
+/*
+ * The block of an nblocks block Bloom filter that key hash h falls in,
+ * and the k bits within that block it sets, in bit[0..k).  The hash is
+ * remixed first, since the table and slot already consume its bits.
+ */
+static uint64 mix(uint64 x)
+{
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ULL;
+  x ^= x >> 33;
+  return x;
+}
+
+uint64 cdb_bloomprobe(uint32 h,uint64 nblocks,unsigned int k,unsigned int *bit)
+{
+  uint64 x, block;
+  unsigned int i;
+
+  x = mix(h + K1);
+  block = ((x >> 32) * nblocks) >> 32; /* nblocks <= 2^32 */
+  x = mix(x + K2);
+  for (i = 0;i < k;++i) {
+    if (i && !(i % 7)) x = mix(x + K1); /* seven 9-bit picks per word */
+    bit[i] = x & (8 * CDB_BLOOMBLOCK - 1);
+    x >>= 9;
+  }
+  return block;
+}
@@ -1,60 +1,347 @@
 /* Public domain. */
 /* Adapted from DJB's original cdb-0.75 package */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* O_DIRECT, fallocate() */
+#endif
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <pthread.h>
+#include <string.h>
 #include <errno.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
 #include "cdb.h"
 #include "cdb_make.h"
 #include "uint32.h"
 
-static int cdb_make_write(struct cdb_make *c, char *buf, uint32 sz) {
-  fwrite(buf, sz, 1, c->fp);
-  return ferror(c->fp);
+/*
+ * Output goes through one large aligned buffer.  Small writes are
+ * gathered there; a write that does not fit is sent along with the
+ * pending bytes in a single writev().  File space is reserved ahead
+ * of the data with fallocate(), and in O_DIRECT mode only whole
+ * buffers are written until cdb_make_finish() drains the tail.
+ */
+
+static int writeall(int fd,const char *buf,uint64 len)
+{
+  ssize_t r;
+
+  while (len > 0) {
+    r = write(fd,buf,len);
+    if (r == -1) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    buf += r;
+    len -= r;
+  }
+  return 0;
 }
 
-int cdb_make_start(struct cdb_make *c, FILE * f)
+static void cdb_make_reserve(struct cdb_make *c,uint64 end)
 {
-  c->head = 0;
-  c->split = 0;
-  c->hash = 0;
-  c->numentries = 0;
-  c->fp = f;
-  c->pos = sizeof c->final;
-  if (fseek(f,c->pos,SEEK_SET) == -1) {
-    perror("fseek failed");
-    return -1;
+#ifdef FALLOC_FL_KEEP_SIZE
+  uint64 len;
+
+  if (end <= c->reserved) return;
+  len = end - c->reserved;
+  len += CDB_PREALLOC - 1;
+  len -= len % CDB_PREALLOC;
+  if (fallocate(c->fd,FALLOC_FL_KEEP_SIZE,c->reserved,len) == -1)
+    c->reserved = ~(uint64) 0; /* not supported here; write regardless */
+  else
+    c->reserved += len;
+#endif
+}
+
+static int cdb_make_flush(struct cdb_make *c)
+{
+  cdb_make_reserve(c,c->boff + c->blen);
+  if (writeall(c->fd,c->buf,c->blen) == -1) return -1;
+  c->boff += c->blen;
+  c->blen = 0;
+  return 0;
+}
+
+static int cdb_make_write(struct cdb_make *c,const char *buf,uint64 len)
+{
+  struct iovec iov[2];
+  uint64 n;
+  ssize_t r;
+
+  if (len < CDB_WBUF - c->blen) {
+    memcpy(c->buf + c->blen,buf,len);
+    c->blen += len;
+    return 0;
+  }
+
+  if (c->direct) {
+    while (len > 0) {
+      n = CDB_WBUF - c->blen;
+      if (n > len) n = len;
+      memcpy(c->buf + c->blen,buf,n);
+      c->blen += n;
+      buf += n;
+      len -= n;
+      if ((c->blen == CDB_WBUF) && (cdb_make_flush(c) == -1)) return -1;
+    }
+    return 0;
+  }
+
+  n = c->blen;
+  cdb_make_reserve(c,c->boff + n + len);
+  iov[0].iov_base = c->buf;
+  iov[0].iov_len = n;
+  iov[1].iov_base = (char *) buf;
+  iov[1].iov_len = len;
+  do
+    r = writev(c->fd,iov,2);
+  while ((r == -1) && (errno == EINTR));
+  if (r == -1) return -1;
+  c->boff += n + len;
+  c->blen = 0;
+  if (r < n) {
+    if (writeall(c->fd,c->buf + r,n - r) == -1) return -1;
+    r = n;
+  }
+  return writeall(c->fd,buf + (r - n),len - (r - n));
+}
+
+/* write out whatever is pending, leaving O_DIRECT mode */
+static int cdb_make_drain(struct cdb_make *c)
+{
+  unsigned int n;
+  int fl;
+
+  if (c->direct) {
+    n = c->blen - c->blen % CDB_ALIGN;
+    if (n) {
+      cdb_make_reserve(c,c->boff + n);
+      if (writeall(c->fd,c->buf,n) == -1) return -1;
+      memmove(c->buf,c->buf + n,c->blen - n);
+      c->boff += n;
+      c->blen -= n;
+    }
+    fl = fcntl(c->fd,F_GETFL);
+    if (fl == -1) return -1;
+    if (fcntl(c->fd,F_SETFL,fl & ~O_DIRECT) == -1) return -1;
+    c->direct = 0;
   }
-  return ftell(c->fp);
+  return cdb_make_flush(c);
+}
+
+/* bypass the page cache for the records, if the system allows it */
+int cdb_make_direct(struct cdb_make *c)
+{
+#ifdef O_DIRECT
+  int fl;
+
+  fl = fcntl(c->fd,F_GETFL);
+  if (fl == -1) return -1;
+  if (fcntl(c->fd,F_SETFL,fl | O_DIRECT) == -1) return -1;
+  c->direct = 1;
+  return 0;
+#else
+  errno = EINVAL;
+  return -1;
+#endif
 }
 
-static int posplus(struct cdb_make *c,uint32 len)
+static void cdb_make_pack(struct cdb_make *c, char *buf, uint64 u) {
+  if (c->w == 8)
+    uint64_pack(buf, u);
+  else
+    uint32_pack(buf, (uint32) u);
+}
+
+int cdb_make_start(struct cdb_make *c, int fd, uint32 flags)
 {
-  uint32 newpos = c->pos + len;
+  void *buf;
+  int i;
+
+  for (i = 0;i < 256;++i) {
+    c->count[i] = 0;
+    c->hp[i] = 0;
+    c->room[i] = 0;
+  }
+  c->numentries = 0;
+  c->threads = 1;
+  c->bloombits = 0;
+  c->load = CDB_LOAD;
+  c->slots = c->hitprobes = c->missprobes = 0;
+  c->spillbuf = 0;
+  c->unordered = 0;
+  c->tomb = 0;
+  c->ntombs = c->tombroom = 0;
+  c->tombkeys = 0;
+  c->tombkeylen = c->tombkeyroom = 0;
+  c->fd = fd;
+  c->flags = flags;
+  c->w = (flags & CDB_F_64) ? 8 : 4;
+  c->direct = 0;
+  c->reserved = 0;
+  c->boff = 0;
+
+  errno = posix_memalign(&buf,CDB_ALIGN,CDB_WBUF);
+  if (errno) { c->buf = 0; return -1; }
+  c->buf = buf;
+
+  /* the header goes out as zeros now, and is rewritten at the end */
+  c->pos = c->blen = c->w << 9;
+  memset(c->buf,0,c->blen);
+  return 0;
+}
+
+static int posplus(struct cdb_make *c,uint64 len)
+{
+  uint64 newpos = c->pos + len;
   if (newpos < len) { errno = ENOMEM; return -1; }
+  if ((c->w == 4) && (newpos > 0xffffffff)) { errno = ENOMEM; return -1; }
   c->pos = newpos;
   return 0;
 }
 
-int cdb_make_addend(struct cdb_make *c,unsigned int keylen,unsigned int datalen,uint32 h)
+/*
+ * Bounded-memory builds: rather than keeping every (hash, position)
+ * pair until cdb_make_finish(), send each to one of 256 partition
+ * files by table, h & 255, in dir.  cdb_make_finish() then reads back
+ * one table's pairs at a time, so memory follows the largest table
+ * instead of the whole file.  Call before adding anything.
+ */
+int cdb_make_spill(struct cdb_make *c,const char *dir)
 {
-  struct cdb_hplist *head;
+  char *fn;
+  int i;
 
-  head = c->head;
-  if (!head || (head->num >= CDB_HPLIST)) {
-    head = (struct cdb_hplist *) malloc(sizeof(struct cdb_hplist));
-    if (!head) return -1;
-    head->num = 0;
-    head->next = c->head;
-    c->head = head;
+  if (c->numentries || c->spillbuf) { errno = EINVAL; return -1; }
+  fn = malloc(strlen(dir) + 32);
+  if (!fn) return -1;
+  c->spillbuf = malloc(256 * CDB_SPILLBUF);
+  if (!c->spillbuf) { free(fn); return -1; }
+
+  for (i = 0;i < 256;++i) {
+    c->spilllen[i] = 0;
+    sprintf(fn,"%s/cdbspill.XXXXXX",dir);
+    c->spillfd[i] = mkstemp(fn);
+    if (c->spillfd[i] == -1) break;
+    unlink(fn);
+  }
+  free(fn);
+  if (i == 256) return 0;
+
+  while (i--) close(c->spillfd[i]);
+  free(c->spillbuf);
+  c->spillbuf = 0;
+  return -1;
+}
+
+static int cdb_make_spillflush(struct cdb_make *c,int i)
+{
+  if (writeall(c->spillfd[i],c->spillbuf + i * CDB_SPILLBUF,c->spilllen[i]) == -1) return -1;
+  c->spilllen[i] = 0;
+  return 0;
+}
+
+static int cdb_make_spilladd(struct cdb_make *c,uint32 h,uint64 p)
+{
+  struct cdb_hp hp;
+  int i = h & 255;
+
+  if (c->spilllen[i] + sizeof hp > CDB_SPILLBUF)
+    if (cdb_make_spillflush(c,i) == -1) return -1;
+  hp.h = h;
+  hp.p = p;
+  memcpy(c->spillbuf + i * CDB_SPILLBUF + c->spilllen[i],&hp,sizeof hp);
+  c->spilllen[i] += sizeof hp;
+  ++c->count[i];
+  return 0;
+}
+
+/* read n pairs of partition i, starting with pair u */
+static int cdb_make_spillread(struct cdb_make *c,int i,struct cdb_hp *hp,uint64 u,uint64 n)
+{
+  char *buf = (char *) hp;
+  uint64 len = n * sizeof *hp;
+  uint64 off = u * sizeof *hp;
+  ssize_t r;
+
+  while (len > 0) {
+    r = pread(c->spillfd[i],buf,len,off);
+    if (r == -1) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    if (r == 0) { errno = EIO; return -1; }
+    buf += r;
+    len -= r;
+    off += r;
+  }
+  return 0;
+}
+
+/*
+ * Pairs are kept per table, each in one array that grows by doubling,
+ * so cdb_make_finish() hands them to the workers as they are.  Given
+ * the number of records to expect, room for all of them is made up
+ * front, with some slack for tables that draw more than their share.
+ */
+static int cdb_make_grow(struct cdb_make *c,int i,uint64 room)
+{
+  struct cdb_hp *hp;
+
+  if (room < CDB_HPROOM) room = CDB_HPROOM;
+  if (room > ((size_t) 0 - (size_t) 1) / sizeof *hp) { errno = ENOMEM; return -1; }
+  hp = (struct cdb_hp *) realloc(c->hp[i],room * sizeof *hp);
+  if (!hp) return -1;
+  c->hp[i] = hp;
+  c->room[i] = room;
+  return 0;
+}
+
+int cdb_make_expect(struct cdb_make *c,uint64 records)
+{
+  uint64 room;
+  int i;
+
+  if (c->spillbuf) return 0;
+  room = records / 256;
+  room += room / 8 + 16;
+  for (i = 0;i < 256;++i)
+    if (c->room[i] < room)
+      if (cdb_make_grow(c,i,room) == -1) return -1;
+  return 0;
+}
+
+/* file the record at p under the table its hash picks */
+static int cdb_make_addhp(struct cdb_make *c,uint32 h,uint64 p)
+{
+  int i;
+
+  if (c->spillbuf) {
+    if (cdb_make_spilladd(c,h,p) == -1) return -1;
+  }
+  else {
+    i = h & 255;
+    if (c->count[i] == c->room[i])
+      if (cdb_make_grow(c,i,c->room[i] * 2) == -1) return -1;
+    c->hp[i][c->count[i]].h = h;
+    c->hp[i][c->count[i]].p = p;
+    ++c->count[i];
   }
-  head->hp[head->num].h = h;
-  head->hp[head->num].p = c->pos;
-  ++head->num;
   ++c->numentries;
-  if (posplus(c,8) == -1) return -1;
+  return 0;
+}
+
+int cdb_make_addend(struct cdb_make *c,unsigned int keylen,unsigned int datalen,uint32 h)
+{
+  if (cdb_make_addhp(c,h,c->pos) == -1) return -1;
+  if (posplus(c,c->w + c->w) == -1) return -1;
   if (posplus(c,keylen) == -1) return -1;
   if (posplus(c,datalen) == -1) return -1;
   return 0;
@@ -62,14 +349,14 @@ int cdb_make_addend(struct cdb_make *c,unsigned int keylen,unsigned int datalen,
 
 int cdb_make_addbegin(struct cdb_make *c,unsigned int keylen,unsigned int datalen)
 {
-  char buf[8];
+  char buf[16];
 
   if (keylen > 0xffffffff) { errno = ENOMEM; return -1; }
   if (datalen > 0xffffffff) { errno = ENOMEM; return -1; }
 
-  uint32_pack(buf,keylen);
-  uint32_pack(buf + 4,datalen);
-  if (cdb_make_write(c,buf,8) != 0) return -1;
+  cdb_make_pack(c,buf,keylen);
+  cdb_make_pack(c,buf + c->w,datalen);
+  if (cdb_make_write(c,buf,c->w + c->w) == -1) return -1;
   /* if (buffer_putalign(&c->b,buf,8) == -1) return -1; */
   return 0;
 }
@@ -77,104 +364,955 @@ int cdb_make_addbegin(struct cdb_make *c,unsigned int keylen,unsigned int datale
 int cdb_make_add(struct cdb_make *c,char *key,unsigned int keylen,char *data,unsigned int datalen)
 {
   if (cdb_make_addbegin(c,keylen,datalen) == -1) return -1;
-  if (cdb_make_write(c,key,keylen) != 0) return -1;
-  if (cdb_make_write(c,data,datalen) != 0) return -1;
+  if (cdb_make_write(c,key,keylen) == -1) return -1;
+  if (cdb_make_write(c,data,datalen) == -1) return -1;
   /* if (buffer_putalign(&c->b,key,keylen) == -1) return -1; */
   /* if (buffer_putalign(&c->b,data,datalen) == -1) return -1; */
-  return cdb_make_addend(c,keylen,datalen,cdb_hash(key,keylen));
+  return cdb_make_addend(c,keylen,datalen,cdb_hashf(c->flags,key,keylen));
 }
 
-int cdb_make_finish(struct cdb_make *c)
+/*
+ * Add a record to the one of n files cdb_shard() picks for its key.
+ * The files must all hash keys the same way.
+ */
+int cdb_make_shardadd(struct cdb_make **c,unsigned int n,char *key,unsigned int keylen,char *data,unsigned int datalen)
+{
+  uint32 h = cdb_hashf(c[0]->flags,key,keylen);
+  struct cdb_make *m = c[cdb_shard(h,n)];
+
+  if (cdb_make_addbegin(m,keylen,datalen) == -1) return -1;
+  if (cdb_make_write(m,key,keylen) == -1) return -1;
+  if (cdb_make_write(m,data,datalen) == -1) return -1;
+  return cdb_make_addend(m,keylen,datalen,h);
+}
+
+/*
+ * Record a tombstone for key: the file will hide it in any file
+ * beneath this one in a stack, though not in this file's own records.
+ * See CDB_S_TOMBS.
+ */
+int cdb_make_delete(struct cdb_make *c,char *key,unsigned int len)
+{
+  struct cdb_tomb *t;
+  char *x;
+  uint64 room;
+
+  if (len > 0xffffffff) { errno = ENOMEM; return -1; }
+  if (c->ntombs == c->tombroom) {
+    room = c->tombroom ? c->tombroom * 2 : CDB_HPROOM;
+    if (room > ((size_t) 0 - (size_t) 1) / sizeof *t) { errno = ENOMEM; return -1; }
+    t = (struct cdb_tomb *) realloc(c->tomb,room * sizeof *t);
+    if (!t) return -1;
+    c->tomb = t;
+    c->tombroom = room;
+  }
+  if (c->tombkeyroom - c->tombkeylen < len) {
+    room = c->tombkeyroom ? c->tombkeyroom : 4096;
+    while (room - c->tombkeylen < len) room *= 2;
+    if (room != (size_t) room) { errno = ENOMEM; return -1; }
+    x = realloc(c->tombkeys,room);
+    if (!x) return -1;
+    c->tombkeys = x;
+    c->tombkeyroom = room;
+  }
+
+  t = c->tomb + c->ntombs++;
+  t->h = cdb_hashf(c->flags,key,len);
+  t->len = len;
+  t->p = c->tombkeylen;
+  memcpy(c->tombkeys + c->tombkeylen,key,len);
+  c->tombkeylen += len;
+  return 0;
+}
+
+/*
+ * cdb_make_load() adds the records of cdbmake input read from fd,
+ *
+ *   +klen,dlen:key->data\n ... \n
+ *
+ * through the blank line that ends it, reading CDB_LOADBUF bytes at a
+ * time.  Only a key need fit in memory; data is copied through in
+ * pieces.  Returns 0, -1 on a read or write error, or -2 if the input
+ * is not in that format, which includes ending early.  It returns -3
+ * instead if either failure comes after a record's key was written,
+ * with errno 0 for bad input: those bytes are already out, so the
+ * file cannot be finished.  In every case *added is the number of
+ * records added.
+ */
+
+struct cdb_load {
+  int fd;
+  char *buf;
+  uint64 size; /* allocated */
+  uint64 len; /* read */
+  uint64 off; /* consumed */
+} ;
+
+/* make n unconsumed bytes available: 0, -1 on error, -2 at the end */
+static int loadneed(struct cdb_load *l,uint64 n)
+{
+  char *buf;
+  ssize_t r;
+
+  if (l->len - l->off >= n) return 0;
+  if (l->off) {
+    memmove(l->buf,l->buf + l->off,l->len - l->off);
+    l->len -= l->off;
+    l->off = 0;
+  }
+  if (n > l->size) {
+    if (n != (size_t) n) { errno = ENOMEM; return -1; }
+    buf = realloc(l->buf,n);
+    if (!buf) return -1;
+    l->buf = buf;
+    l->size = n;
+  }
+  while (l->len < n) {
+    r = read(l->fd,l->buf + l->len,l->size - l->len);
+    if (r == -1) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    if (r == 0) return -2;
+    l->len += r;
+  }
+  return 0;
+}
+
+/* a decimal length up to the byte end */
+static int loadnum(struct cdb_load *l,uint64 *u,char end)
+{
+  unsigned int digits = 0;
+  int r;
+  char ch;
+
+  *u = 0;
+  for (;;) {
+    if ((r = loadneed(l,1))) return r;
+    ch = l->buf[l->off++];
+    if (ch == end) return digits ? 0 : -2;
+    if ((ch < '0') || (ch > '9')) return -2;
+    *u = *u * 10 + (ch - '0');
+    if (*u > 0xffffffff) { errno = ENOMEM; return -1; }
+    ++digits;
+  }
+}
+
+int cdb_make_load(struct cdb_make *c,int fd,uint64 *added)
+{
+  struct cdb_load l;
+  uint64 klen, dlen;
+  uint64 n, m;
+  uint32 h;
+  int begun = 0;
+  int r;
+
+  *added = 0;
+  l.fd = fd;
+  l.size = CDB_LOADBUF;
+  l.len = l.off = 0;
+  l.buf = malloc(l.size);
+  if (!l.buf) return -1;
+
+  for (;;) {
+    if ((r = loadneed(&l,1))) break;
+    if (l.buf[l.off++] != '+') {
+      if (l.buf[l.off - 1] != '\n') r = -2;
+      break;
+    }
+    if ((r = loadnum(&l,&klen,','))) break;
+    if ((r = loadnum(&l,&dlen,':'))) break;
+
+    if ((r = loadneed(&l,klen + 2))) break;
+    if (memcmp(l.buf + l.off + klen,"->",2)) { r = -2; break; }
+    h = cdb_hashf(c->flags,l.buf + l.off,klen);
+    begun = 1;
+    if ((r = cdb_make_addbegin(c,klen,dlen))) break;
+    if ((r = cdb_make_write(c,l.buf + l.off,klen))) break;
+    l.off += klen + 2;
+
+    for (n = dlen;n > 0;n -= m) {
+      if ((r = loadneed(&l,1))) break;
+      m = l.len - l.off;
+      if (m > n) m = n;
+      if ((r = cdb_make_write(c,l.buf + l.off,m))) break;
+      l.off += m;
+    }
+    if (r) break;
+
+    if ((r = loadneed(&l,1))) break;
+    if (l.buf[l.off++] != '\n') { r = -2; break; }
+    if ((r = cdb_make_addend(c,klen,dlen,h))) break;
+    begun = 0;
+    ++*added;
+  }
+
+  free(l.buf);
+  if (r && begun) {
+    if (r == -2) errno = 0;
+    r = -3;
+  }
+  return r;
+}
+
+/*
+ * cdb_make_merge() copies the records of old, but for those at the
+ * positions in skip (which it sorts), to the file.  Each run of
+ * records between skipped ones goes across in one piece, within the
+ * kernel where the system allows, and each record's hash is taken
+ * from old's tables rather than computed again.  A file of another
+ * width or hash function is copied a record at a time instead.
+ *
+ * Table slots come in slot order, not position order, so the pairs
+ * are marked to be sorted by position, which is the order added,
+ * before the tables are built; see hpsort().
+ */
+
+static int poscmp(const void *x,const void *y)
+{
+  uint64 a = *(const uint64 *) x;
+  uint64 b = *(const uint64 *) y;
+  return a < b ? -1 : a > b;
+}
+
+/*
+ * Sort n pairs by position, 11 bits at a time from the bottom, going
+ * back and forth through tmp, which has room for n.  Positions are
+ * below max.
+ */
+static void hpsort(struct cdb_hp *hp,struct cdb_hp *tmp,uint64 n,uint64 max)
 {
-  char buf[8];
+  uint64 count[2048];
+  struct cdb_hp *from = hp, *to = tmp, *x;
+  uint64 u, sum, t;
+  unsigned int shift;
+
+  for (shift = 0;(shift < 64) && (max >> shift);shift += 11) {
+    memset(count,0,sizeof count);
+    for (u = 0;u < n;++u)
+      ++count[(from[u].p >> shift) & 2047];
+    for (sum = u = 0;u < 2048;++u) {
+      t = count[u];
+      count[u] = sum;
+      sum += t;
+    }
+    for (u = 0;u < n;++u)
+      to[count[(from[u].p >> shift) & 2047]++] = from[u];
+    x = from;
+    from = to;
+    to = x;
+  }
+  if (from != hp) memcpy(hp,from,n * sizeof *hp);
+}
+
+/* copy len bytes of old from pos; buf has CDB_WBUF bytes */
+static int cdb_make_copy(struct cdb_make *c,struct cdb *old,uint64 pos,uint64 len,char *buf)
+{
+  uint64 n;
+#ifdef SYS_copy_file_range
+  loff_t off;
+  ssize_t r;
+
+  /* short runs are cheaper through the buffer */
+  if (!c->direct && (len >= CDB_WBUF)) {
+    if (cdb_make_flush(c) == -1) return -1;
+    cdb_make_reserve(c,c->boff + len);
+    while (len > 0) {
+      off = pos;
+      n = len > (1 << 30) ? (1 << 30) : len;
+      r = syscall(SYS_copy_file_range,old->fd,&off,c->fd,0,(size_t) n,0);
+      if ((r == -1) && (errno == EINTR)) continue;
+      if (r <= 0) break;
+      c->boff += r;
+      pos += r;
+      len -= r;
+    }
+  }
+#endif
+
+  if (old->map) {
+    if ((pos > old->size) || (old->size - pos < len)) { errno = EPROTO; return -1; }
+    return cdb_make_write(c,old->map + pos,len);
+  }
+  for (;len > 0;len -= n) {
+    n = len > CDB_WBUF ? CDB_WBUF : len;
+    if (cdb_read(old,buf,n,pos) == -1) return -1;
+    if (cdb_make_write(c,buf,n) == -1) return -1;
+    pos += n;
+  }
+  return 0;
+}
+
+/* the slow way: add the records again, one by one */
+static int cdb_make_readd(struct cdb_make *c,struct cdb *old,uint64 eod,uint64 *skip,uint64 nskip)
+{
+  unsigned int w = old->w;
+  char *buf = 0, *x;
+  uint64 size = 0, pos, klen, dlen;
+  uint64 k = 0;
+  char hdr[16];
+
+  for (pos = w << 9;pos < eod;pos += w + w + klen + dlen) {
+    if (cdb_read(old,hdr,w + w,pos) == -1) goto FAIL;
+    klen = cdb_unpackw(hdr,w);
+    dlen = cdb_unpackw(hdr + w,w);
+    if (klen + dlen > eod - pos - w - w) { errno = EPROTO; goto FAIL; }
+    if ((k < nskip) && (skip[k] == pos)) { ++k; continue; }
+    if (klen + dlen > size) {
+      if (klen + dlen != (size_t) (klen + dlen)) { errno = ENOMEM; goto FAIL; }
+      x = realloc(buf,klen + dlen);
+      if (!x) goto FAIL;
+      buf = x;
+      size = klen + dlen;
+    }
+    if (cdb_read(old,buf,klen + dlen,pos + w + w) == -1) goto FAIL;
+    if (cdb_make_add(c,buf,klen,buf + klen,dlen) == -1) goto FAIL;
+  }
+  free(buf);
+  return 0;
+
+  FAIL:
+  free(buf);
+  return -1;
+}
+
+int cdb_make_merge(struct cdb_make *c,struct cdb *old,uint64 *skip,uint64 nskip)
+{
+  char hdr[4096];
+  unsigned int w = old->w;
+  char *buf = 0;
+  uint64 *shift = 0;
+  uint64 *rank = 0;
+  uint64 eod, pos, end, hpos, hslots, p, u, j, m, k, nrank;
+  unsigned int bits;
+  uint32 h;
   int i;
-  uint32 len;
-  uint32 u;
-  uint32 memsize;
-  uint32 count;
-  uint32 where;
-  struct cdb_hplist *x;
-  struct cdb_hp *hp;
 
-  for (i = 0;i < 256;++i)
-    c->count[i] = 0;
+  if (cdb_read(old,hdr,w << 9,0) == -1) return -1;
+  eod = cdb_unpackw(hdr,w);
+  if ((eod < (w << 9)) || (eod > old->size)) { errno = EPROTO; return -1; }
+
+  qsort(skip,nskip,sizeof *skip,poscmp);
+  for (k = j = 0;k < nskip;++k)
+    if (!j || (skip[k] != skip[j - 1]))
+      skip[j++] = skip[k];
+  nskip = j;
+
+  if ((w != c->w) || ((old->flags ^ c->flags) & CDB_F_WORDHASH))
+    return cdb_make_readd(c,old,eod,skip,nskip);
 
-  for (x = c->head;x;x = x->next) {
-    i = x->num;
-    while (i--)
-      ++c->count[255 & x->hp[i].h];
+  /* rank[x]: skipped records before x << bits, where the search for
+     a position's run starts */
+  for (bits = 0;(eod >> bits) > 4 * nskip + 4;++bits) ;
+  nrank = (eod >> bits) + 1;
+
+  buf = malloc(CDB_WBUF);
+  shift = (uint64 *) malloc((nskip + 1) * sizeof *shift);
+  rank = (uint64 *) malloc(nrank * sizeof *rank);
+  if (!buf || !shift || !rank) goto FAIL;
+
+  for (k = u = 0;u < nrank;++u) {
+    while ((k < nskip) && (skip[k] < (u << bits))) ++k;
+    rank[u] = k;
   }
 
-  memsize = 1;
+  /* the runs between skipped records, each moving by shift[k] */
+  pos = w << 9;
+  for (k = 0;k <= nskip;++k) {
+    end = (k < nskip) ? skip[k] : eod;
+    if ((end < pos) || (end > eod)) { errno = EPROTO; goto FAIL; }
+    shift[k] = c->pos - pos;
+    if (posplus(c,end - pos) == -1) goto FAIL;
+    if (cdb_make_copy(c,old,pos,end - pos,buf) == -1) goto FAIL;
+    if (k == nskip) break;
+    if (cdb_read(old,hdr,w + w,end) == -1) goto FAIL;
+    u = cdb_unpackw(hdr,w) + cdb_unpackw(hdr + w,w);
+    if (u > eod - end - w - w) { errno = EPROTO; goto FAIL; }
+    pos = end + w + w + u;
+  }
+
+  /* then every record's hash, from the slots */
+  if (cdb_read(old,hdr,w << 9,0) == -1) goto FAIL;
   for (i = 0;i < 256;++i) {
-    u = c->count[i] * 2;
-    if (u > memsize)
-      memsize = u;
+    hpos = cdb_unpackw(hdr + 2 * w * i,w);
+    hslots = cdb_unpackw(hdr + 2 * w * i + w,w);
+    if ((hpos > old->size) || ((old->size - hpos) / (w + w) < hslots)) { errno = EPROTO; goto FAIL; }
+    for (u = 0;u < hslots;u += m) {
+      m = hslots - u;
+      if (m > CDB_WBUF / (w + w)) m = CDB_WBUF / (w + w);
+      if (cdb_read(old,buf,m * (w + w),hpos + u * (w + w)) == -1) goto FAIL;
+      for (j = 0;j < m;++j) {
+        p = cdb_unpackw(buf + j * (w + w) + w,w);
+        if (!p) continue;
+        if ((p < (w << 9)) || (p >= eod)) { errno = EPROTO; goto FAIL; }
+        h = cdb_unpackw(buf + j * (w + w),w);
+        /* k: skipped records at or before p */
+        for (k = rank[p >> bits];(k < nskip) && (skip[k] <= p);++k) ;
+        if (k && (skip[k - 1] == p)) continue;
+        if (cdb_make_addhp(c,h,p + shift[k]) == -1) goto FAIL;
+      }
+    }
   }
 
-  memsize += c->numentries; /* no overflow possible up to now */
-  u = (uint32) 0 - (uint32) 1;
-  u /= sizeof(struct cdb_hp);
-  if (memsize > u) { errno = ENOMEM; return -1; }
+  c->unordered = 1;
+  free(rank);
+  free(shift);
+  free(buf);
+  return 0;
 
-  c->split = (struct cdb_hp *) malloc(memsize * sizeof(struct cdb_hp));
-  if (!c->split) return -1;
+  FAIL:
+  free(rank);
+  free(shift);
+  free(buf);
+  return -1;
+}
 
-  c->hash = c->split + c->numentries;
+/* write all of buf at offset off */
+static int cdb_make_pwrite(struct cdb_make *c,char *buf,uint64 len,uint64 off)
+{
+  ssize_t r;
 
-  u = 0;
-  for (i = 0;i < 256;++i) {
-    u += c->count[i]; /* bounded by numentries, so no overflow */
-    c->start[i] = u;
+  while (len > 0) {
+    r = pwrite(c->fd,buf,len,off);
+    if (r == -1) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    buf += r;
+    len -= r;
+    off += r;
   }
+  return 0;
+}
+
+/* place the entries of table i in hash, and write it out at off */
+/*
+ * Robin Hood insertion: a record passing a slot whose occupant sits
+ * closer to its own home slot takes the slot, and the occupant moves
+ * on instead.  Probe runs stay unbroken, so plain cdb_findnext() reads
+ * the result, but every run is ordered by home slot, which lets a
+ * reader stop a miss early, and distances even out.  Records with the
+ * same home, among them all records under one key, keep file order.
+ */
+static void robinhood(struct cdb_hp *hash,uint64 len,struct cdb_hp x)
+{
+  struct cdb_hp y;
+  uint64 where, d, dy;
 
-  for (x = c->head;x;x = x->next) {
-    i = x->num;
-    while (i--)
-      c->split[--c->start[255 & x->hp[i].h]] = x->hp[i];
+  where = (x.h >> 8) % len;
+  d = 0;
+  while (hash[where].p) {
+    dy = (where + len - (hash[where].h >> 8) % len) % len;
+    if ((dy < d) || ((dy == d) && (hash[where].p > x.p))) {
+      y = hash[where];
+      hash[where] = x;
+      x = y;
+      d = dy;
+    }
+    if (++where == len)
+      where = 0;
+    ++d;
   }
+  hash[where] = x;
+}
 
-  for (i = 0;i < 256;++i) {
-    count = c->count[i];
+/* slots in a table of count records at c->load */
+static uint64 cdb_make_slots(struct cdb_make *c,uint64 count)
+{
+  if (c->load == CDB_LOAD) return count + count; /* no overflow possible */
+  return (count * 65536 + c->load - 1) / c->load; /* count < 2^44 */
+}
+
+/*
+ * Slots a lookup reads, the last empty one included: *hit for finding
+ * every record of the table once, *miss for a miss starting at each
+ * slot in turn.  A miss runs to the next empty slot, which a run of r
+ * records puts r, r - 1, ... 1 slots away; under CDB_F_ROBINHOOD it
+ * may stop sooner, and is followed slot by slot.
+ */
+static void cdb_make_probes(struct cdb_make *c,struct cdb_hp *hash,uint64 len,uint64 *hit,uint64 *miss)
+{
+  uint64 u, j, d, r, first;
+
+  *hit = *miss = 0;
+  if (!len) return;
+
+  first = len;
+  for (u = 0;u < len;++u)
+    if (hash[u].p)
+      *hit += (u + len - (hash[u].h >> 8) % len) % len + 1;
+    else if (first == len)
+      first = u;
+
+  if (first == len) { *miss = len * len; return; }
+
+  if (c->flags & CDB_F_ROBINHOOD) {
+    for (u = 0;u < len;++u) {
+      for (j = 0,d = u;j < len;++j) {
+        if (!hash[d].p) break;
+        if ((d + len - (hash[d].h >> 8) % len) % len < j) break;
+        if (++d == len) d = 0;
+      }
+      *miss += (j < len) ? j + 1 : len;
+    }
+    return;
+  }
 
-    len = count + count; /* no overflow possible */
-    uint32_pack(c->final + 8 * i,c->pos);
-    uint32_pack(c->final + 8 * i + 4,len);
+  r = 0;
+  for (j = 1,u = first + 1;j <= len;++j,++u) {
+    if (u == len) u = 0;
+    if (hash[u].p) { ++r; continue; }
+    *miss += r * (r + 1) / 2 + r + 1;
+    r = 0;
+  }
+}
+
+static int cdb_make_table(struct cdb_make *c,int i,uint64 off,struct cdb_hp *hp,struct cdb_hp *hash,char *out,uint64 *hit,uint64 *miss)
+{
+  unsigned int w = c->w;
+  uint64 count;
+  uint64 len;
+  uint64 u;
+  uint64 where;
+  uint64 n;
+
+  count = c->count[i];
+  len = cdb_make_slots(c,count);
 
-    for (u = 0;u < len;++u)
-      c->hash[u].h = c->hash[u].p = 0;
+  for (u = 0;u < len;++u)
+    hash[u].h = hash[u].p = 0;
 
-    hp = c->split + c->start[i];
+  if (c->flags & CDB_F_ROBINHOOD)
+    for (u = 0;u < count;++u)
+      robinhood(hash,len,*hp++);
+  else
     for (u = 0;u < count;++u) {
       where = (hp->h >> 8) % len;
-      while (c->hash[where].p)
+      while (hash[where].p)
 	if (++where == len)
 	  where = 0;
-      c->hash[where] = *hp++;
+      hash[where] = *hp++;
     }
 
-    for (u = 0;u < len;++u) {
-      uint32_pack(buf,c->hash[u].h);
-      uint32_pack(buf + 4,c->hash[u].p);
-      if (cdb_make_write(c,buf,8) != 0) return -1;
-      /* if (buffer_putalign(&c->b,buf,8) == -1) return -1; */
-      if (posplus(c,8) == -1) return -1;
+  cdb_make_probes(c,hash,len,hit,miss);
+
+  n = 0;
+  for (u = 0;u < len;++u) {
+    cdb_make_pack(c,out + n,hash[u].h);
+    cdb_make_pack(c,out + n + w,hash[u].p);
+    n += w + w;
+    if ((n == CDB_TABLEBUF) || (u + 1 == len)) {
+      if (cdb_make_pwrite(c,out,n,off) == -1) return -1;
+      off += n;
+      n = 0;
+    }
+  }
+  return 0;
+}
+
+struct cdb_make_job {
+  struct cdb_make *c;
+  uint64 where[256]; /* file offset of each table */
+  uint64 maxlen; /* slots in the largest table */
+  uint64 maxcount; /* records in the largest table */
+  uint64 hit[256]; /* cdb_make_probes() of each table */
+  uint64 miss[256];
+  int next; /* next table to build */
+  int err; /* errno of the first failure */
+  pthread_mutex_t lock;
+} ;
+
+static void *cdb_make_worker(void *arg)
+{
+  struct cdb_make_job *job = arg;
+  struct cdb_make *c = job->c;
+  struct cdb_hp *hash;
+  struct cdb_hp *hp = 0;
+  char *out;
+  int err = 0;
+  int i;
+
+  hash = (struct cdb_hp *) malloc(job->maxlen * sizeof(struct cdb_hp));
+  out = malloc(CDB_TABLEBUF);
+  if (!hash || !out) err = ENOMEM;
+  if (c->spillbuf || c->unordered) {
+    hp = (struct cdb_hp *) malloc(job->maxcount * sizeof(struct cdb_hp));
+    if (!hp) err = ENOMEM;
+  }
+
+  for (;;) {
+    pthread_mutex_lock(&job->lock);
+    if (err && !job->err) job->err = err;
+    i = job->err ? 256 : job->next++;
+    pthread_mutex_unlock(&job->lock);
+    if (i >= 256) break;
+    if (!hp) {
+      if (cdb_make_table(c,i,job->where[i],c->hp[i],hash,out,job->hit + i,job->miss + i) == -1) err = errno;
+      continue;
+    }
+    /* a copy, as the Bloom filter may be reading c->hp[i] meanwhile */
+    if (!c->spillbuf)
+      memcpy(hp,c->hp[i],c->count[i] * sizeof *hp);
+    else if (cdb_make_spillread(c,i,hp,0,c->count[i]) == -1) {
+      err = errno;
+      continue;
+    }
+    if (c->unordered) hpsort(hp,hash,c->count[i],c->pos);
+    if (cdb_make_table(c,i,job->where[i],hp,hash,out,job->hit + i,job->miss + i) == -1) err = errno;
+  }
+
+  free(hash);
+  free(hp);
+  free(out);
+  return 0;
+}
+
+/*
+ * Size a blocked Bloom filter for n records at bits bits each, as a
+ * CDB_S_BLOOM section: k probes, nblocks blocks, and the padding that
+ * aligns the blocks once the section starts at pos.
+ */
+static uint64 cdb_make_bloomsize(struct cdb_make *c,uint64 pos,uint32 *k,uint32 *pad)
+{
+  uint64 n;
+
+  n = (c->numentries * c->bloombits + 8 * CDB_BLOOMBLOCK - 1) / (8 * CDB_BLOOMBLOCK);
+  if (!n) n = 1;
+  if (n > ((uint64) 1 << 32)) n = (uint64) 1 << 32;
+  *k = (c->bloombits * 69 + 50) / 100; /* bits * ln 2, rounded */
+  if (*k < 1) *k = 1;
+  if (*k > CDB_BLOOMMAXK) *k = CDB_BLOOMMAXK;
+  pos += CDB_SECTHEAD + 16;
+  *pad = (CDB_BLOOMBLOCK - pos % CDB_BLOOMBLOCK) % CDB_BLOOMBLOCK;
+  return n;
+}
+
+static void cdb_make_bloomadd(unsigned char *bloom,uint64 n,unsigned int k,struct cdb_hp *hp,uint64 count)
+{
+  unsigned int bit[CDB_BLOOMMAXK];
+  unsigned char *p;
+  uint64 u;
+  unsigned int i;
+
+  for (u = 0;u < count;++u) {
+    p = bloom + cdb_bloomprobe(hp[u].h,n,k,bit) * CDB_BLOOMBLOCK;
+    for (i = 0;i < k;++i)
+      p[bit[i] >> 3] |= 1 << (bit[i] & 7);
+  }
+}
+
+static int cdb_make_bloomfill(struct cdb_make *c,unsigned char *bloom,uint64 n,unsigned int k)
+{
+  struct cdb_hp *hp;
+  uint64 m, u;
+  int i;
+
+  if (!c->spillbuf) {
+    for (i = 0;i < 256;++i)
+      cdb_make_bloomadd(bloom,n,k,c->hp[i],c->count[i]);
+    return 0;
+  }
+
+  /* the partition buffers are flushed by now; read through them */
+  hp = (struct cdb_hp *) c->spillbuf;
+  for (i = 0;i < 256;++i)
+    for (u = 0;u < c->count[i];u += m) {
+      m = c->count[i] - u;
+      if (m > 256 * CDB_SPILLBUF / sizeof *hp) m = 256 * CDB_SPILLBUF / sizeof *hp;
+      if (cdb_make_spillread(c,i,hp,u,m) == -1) return -1;
+      cdb_make_bloomadd(bloom,n,k,hp,m);
     }
+  return 0;
+}
+
+static int tombcmp(const void *x,const void *y)
+{
+  const struct cdb_tomb *a = x;
+  const struct cdb_tomb *b = y;
+  if (a->h != b->h) return a->h < b->h ? -1 : 1;
+  return a->p < b->p ? -1 : a->p > b->p;
+}
+
+/* the CDB_S_TOMBS section, head and body, in *out; 0 if none is needed */
+static int cdb_make_tombs(struct cdb_make *c,char **out,uint64 *len)
+{
+  char *s, *e;
+  uint64 i, n = c->ntombs;
+
+  *out = 0;
+  *len = 0;
+  if (!n) return 0;
+
+  *len = CDB_SECTHEAD + 8 + 16 * n + c->tombkeylen;
+  if (*len != (size_t) *len) { errno = ENOMEM; return -1; }
+  s = malloc(*len);
+  if (!s) return -1;
+
+  qsort(c->tomb,n,sizeof *c->tomb,tombcmp);
+  uint32_pack(s,CDB_S_TOMBS);
+  uint32_pack(s + 4,0);
+  uint64_pack(s + 8,*len - CDB_SECTHEAD);
+  uint64_pack(s + CDB_SECTHEAD,n);
+  e = s + CDB_SECTHEAD + 8;
+  for (i = 0;i < n;++i) {
+    uint32_pack(e,c->tomb[i].h);
+    uint32_pack(e + 4,c->tomb[i].len);
+    uint64_pack(e + 8,8 + 16 * n + c->tomb[i].p);
+    e += 16;
   }
+  memcpy(e,c->tombkeys,c->tombkeylen);
+  *out = s;
+  return 0;
+}
+
+int cdb_make_finish(struct cdb_make *c)
+{
+  char buf[CDB_SECTHEAD + 2048];
+  unsigned char *bloom = 0;
+  char *tombs = 0;
+  uint64 tomblen;
+  uint64 bloomblocks = 0;
+  uint64 trailer = 0;
+  uint32 bloomk = 0, bloompad = 0;
+  int i;
+  int n;
+  unsigned int w = c->w;
+  uint64 u;
+  struct cdb_make_job job;
+  pthread_t tid[CDB_MAXTHREADS];
 
-  if (c->split) free(c->split);
+  if (c->spillbuf)
+    for (i = 0;i < 256;++i)
+      if (cdb_make_spillflush(c,i) == -1) return -1;
 
-  for (x = c->head;x;c->head = x) {
-    x = x->next;
-    free(c->head);
+  job.maxlen = 1;
+  job.maxcount = 1;
+  for (i = 0;i < 256;++i) {
+    u = cdb_make_slots(c,c->count[i]);
+    if (u > job.maxlen)
+      job.maxlen = u;
+    if (c->count[i] > job.maxcount)
+      job.maxcount = c->count[i];
   }
 
-  if (fflush(c->fp) != 0) return -1;
+  u = (size_t) 0 - (size_t) 1;
+  u /= sizeof(struct cdb_hp);
+  if (job.maxlen > u) { errno = ENOMEM; return -1; }
+
+  /* every table's offset is known up front, so tables can be built
+     and written in any order */
+  for (i = 0;i < 256;++i) {
+    u = cdb_make_slots(c,c->count[i]);
+    cdb_make_pack(c,c->final + 2 * w * i,c->pos);
+    cdb_make_pack(c,c->final + 2 * w * i + w,u);
+    job.where[i] = c->pos;
+    if (posplus(c,u * (w + w)) == -1) return -1;
+  }
+
+  if (cdb_make_drain(c) == -1) return -1;
   /* if (buffer_flush(&c->b) == -1) return -1; */
-  rewind(c->fp);
-  if (ftell(c->fp) != 0) return -1;
+
+  if (c->bloombits) {
+    bloomblocks = cdb_make_bloomsize(c,c->pos,&bloomk,&bloompad);
+    if (bloomblocks * CDB_BLOOMBLOCK != (size_t) (bloomblocks * CDB_BLOOMBLOCK)) {
+      errno = ENOMEM;
+      return -1;
+    }
+    bloom = calloc(bloomblocks,CDB_BLOOMBLOCK);
+    if (!bloom) return -1;
+    trailer += CDB_SECTHEAD + 16 + bloompad + bloomblocks * CDB_BLOOMBLOCK;
+  }
+  if (c->load != CDB_LOAD) trailer += CDB_SECTHEAD + 2048;
+  if (cdb_make_tombs(c,&tombs,&tomblen) == -1) goto FAIL;
+  trailer += tomblen;
+  if (c->flags || trailer) trailer += CDB_TAILSIZE;
+  cdb_make_reserve(c,c->pos + trailer);
+
+  job.c = c;
+  job.next = 0;
+  job.err = 0;
+  pthread_mutex_init(&job.lock,0);
+
+  n = c->threads;
+  if (n > CDB_MAXTHREADS) n = CDB_MAXTHREADS;
+  for (i = 0;i < n - 1;++i)
+    if (pthread_create(&tid[i],0,cdb_make_worker,&job) != 0)
+      break;
+  n = i;
+  if (bloom && (cdb_make_bloomfill(c,bloom,bloomblocks,bloomk) == -1)) {
+    pthread_mutex_lock(&job.lock);
+    if (!job.err) job.err = errno;
+    pthread_mutex_unlock(&job.lock);
+  }
+  cdb_make_worker(&job);
+  for (i = 0;i < n;++i)
+    pthread_join(tid[i],0);
+
+  pthread_mutex_destroy(&job.lock);
+
+  cdb_make_free(c);
+
+  if (job.err) { errno = job.err; goto FAIL; }
+
+  c->slots = c->hitprobes = c->missprobes = 0;
+  for (i = 0;i < 256;++i) {
+    c->slots += cdb_make_slots(c,c->count[i]);
+    c->hitprobes += job.hit[i];
+    c->missprobes += job.miss[i];
+  }
+
+  if (bloom) {
+    memset(buf,0,CDB_TAILSIZE);
+    uint32_pack(buf,CDB_S_BLOOM);
+    uint64_pack(buf + 8,16 + bloompad + bloomblocks * CDB_BLOOMBLOCK);
+    uint32_pack(buf + 16,bloomk);
+    uint32_pack(buf + 20,bloompad);
+    if (cdb_make_pwrite(c,buf,CDB_SECTHEAD + 8,c->pos) == -1) goto FAIL;
+    uint64_pack(buf,bloomblocks);
+    if (cdb_make_pwrite(c,buf,8,c->pos + CDB_SECTHEAD + 8) == -1) goto FAIL;
+    c->pos += CDB_SECTHEAD + 16 + bloompad;
+    if (cdb_make_pwrite(c,(char *) bloom,bloomblocks * CDB_BLOOMBLOCK,c->pos) == -1) goto FAIL;
+    c->pos += bloomblocks * CDB_BLOOMBLOCK;
+    free(bloom);
+    bloom = 0;
+  }
+
+  if (tombs) {
+    if (cdb_make_pwrite(c,tombs,tomblen,c->pos) == -1) goto FAIL;
+    c->pos += tomblen;
+    free(tombs);
+    tombs = 0;
+  }
+
+  if (c->load != CDB_LOAD) {
+    uint32_pack(buf,CDB_S_COUNTS);
+    uint32_pack(buf + 4,0);
+    uint64_pack(buf + 8,2048);
+    for (i = 0;i < 256;++i)
+      uint64_pack(buf + CDB_SECTHEAD + 8 * i,c->count[i]);
+    if (cdb_make_pwrite(c,buf,CDB_SECTHEAD + 2048,c->pos) == -1) return -1;
+    c->pos += CDB_SECTHEAD + 2048;
+  }
+
+  if (trailer) {
+    uint32_pack(buf,c->flags);
+    uint32_pack(buf + 4,0);
+    uint64_pack(buf + 8,trailer);
+    memcpy(buf + 16,CDB_TAILMAGIC,8);
+    if (cdb_make_pwrite(c,buf,CDB_TAILSIZE,c->pos) == -1) return -1;
+    c->pos += CDB_TAILSIZE;
+  }
+
   /* if (seek_begin(c->fd) == -1) return -1; */
-  if (cdb_make_write(c,c->final,sizeof c->final) != 0) return -1;
-  return fflush(c->fp);
+  if (cdb_make_pwrite(c,c->final,w << 9,0) == -1) return -1;
   /* return buffer_putflush(&c->b,c->final,sizeof c->final); */
+
+  /* give back any space reserved beyond the end */
+  if ((c->reserved > c->pos) && (c->reserved != ~(uint64) 0))
+    if (ftruncate(c->fd,c->pos) == -1) return -1;
+  return 0;
+
+  FAIL:
+  free(bloom);
+  free(tombs);
+  return -1;
+}
+
+/*
+ * cdb_make_shardfinish() finishes n files at once, each in a thread of
+ * its own up to threads, and fsync()s them.  The threads are shared
+ * out, so a few large shards still build their tables in parallel.
+ */
+
+struct cdb_make_shardjob {
+  struct cdb_make **c;
+  unsigned int n;
+  unsigned int next; /* next file to finish */
+  int err; /* errno of the first failure */
+  pthread_mutex_t lock;
+} ;
+
+static void *cdb_make_shardworker(void *arg)
+{
+  struct cdb_make_shardjob *job = arg;
+  unsigned int i;
+  int err;
+
+  for (;;) {
+    pthread_mutex_lock(&job->lock);
+    i = job->next++;
+    if (job->err) i = job->n;
+    pthread_mutex_unlock(&job->lock);
+    if (i >= job->n) break;
+
+    err = 0;
+    if ((cdb_make_finish(job->c[i]) == -1) || (fsync(job->c[i]->fd) == -1))
+      err = errno;
+    if (err) {
+      pthread_mutex_lock(&job->lock);
+      if (!job->err) job->err = err;
+      pthread_mutex_unlock(&job->lock);
+    }
+  }
+  return 0;
+}
+
+int cdb_make_shardfinish(struct cdb_make **c,unsigned int n,int threads)
+{
+  struct cdb_make_shardjob job;
+  pthread_t tid[CDB_MAXTHREADS];
+  unsigned int i, m;
+
+  if (threads < 1) threads = 1;
+  if (threads > CDB_MAXTHREADS) threads = CDB_MAXTHREADS;
+  m = (unsigned int) threads < n ? (unsigned int) threads : n;
+  for (i = 0;i < n;++i)
+    c[i]->threads = threads / m;
+
+  job.c = c;
+  job.n = n;
+  job.next = 0;
+  job.err = 0;
+  pthread_mutex_init(&job.lock,0);
+
+  for (i = 0;i < m - 1;++i)
+    if (pthread_create(&tid[i],0,cdb_make_shardworker,&job) != 0)
+      break;
+  m = i;
+  cdb_make_shardworker(&job);
+  for (i = 0;i < m;++i)
+    pthread_join(tid[i],0);
+
+  pthread_mutex_destroy(&job.lock);
+
+  if (job.err) { errno = job.err; return -1; }
+  return 0;
+}
+
+void cdb_make_free(struct cdb_make *c)
+{
+  int i;
+
+  for (i = 0;i < 256;++i) {
+    free(c->hp[i]);
+    c->hp[i] = 0;
+    c->room[i] = 0;
+  }
+
+  if (c->spillbuf) {
+    for (i = 0;i < 256;++i)
+      close(c->spillfd[i]);
+    free(c->spillbuf);
+    c->spillbuf = 0;
+  }
+
+  free(c->tomb);
+  c->tomb = 0;
+  c->ntombs = c->tombroom = 0;
+  free(c->tombkeys);
+  c->tombkeys = 0;
+  c->tombkeylen = c->tombkeyroom = 0;
+
+  free(c->buf);
+  c->buf = 0;
 }
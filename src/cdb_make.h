@@ -4,38 +4,72 @@
 #ifndef CDB_MAKE_H
 #define CDB_MAKE_H
 
-#include <stdio.h>
 #include "uint32.h"
+#include "uint64.h"
+#include "cdb.h"
 
-#define CDB_HPLIST 1000
+#define CDB_HPROOM 64 /* first allocation for a table's pairs, lacking a hint */
+#define CDB_TABLEBUF 65536 /* bytes of packed slots per table write */
+#define CDB_MAXTHREADS 64
+#define CDB_WBUF (1 << 20) /* output buffer; a multiple of CDB_ALIGN */
+#define CDB_ALIGN 4096 /* O_DIRECT alignment of memory, offsets and sizes */
+#define CDB_PREALLOC (64 << 20) /* fallocate() step */
+#define CDB_LOAD 32768 /* classic load factor, 1/2, in 65536ths */
+#define CDB_SPILLBUF 65536 /* bytes buffered per partition file */
+#define CDB_LOADBUF (1 << 20) /* cdb_make_load() read size */
 
-struct cdb_hp { uint32 h; uint32 p; } ;
-
-struct cdb_hplist {
-  struct cdb_hp hp[CDB_HPLIST];
-  struct cdb_hplist *next;
-  int num;
-} ;
+struct cdb_hp { uint32 h; uint64 p; } ;
+struct cdb_tomb { uint32 h; uint32 len; uint64 p; } ; /* key at tombkeys + p */
 
 struct cdb_make {
   /* char bspace[8192]; */
-  char final[2048];
-  uint32 count[256];
-  uint32 start[256];
-  struct cdb_hplist *head;
-  struct cdb_hp *split; /* includes space for hash */
-  struct cdb_hp *hash;
-  uint32 numentries;
+  char final[4096];
+  uint64 count[256];
+  struct cdb_hp *hp[256]; /* each table's pairs, in the order added */
+  uint64 room[256]; /* pairs allocated in each */
+  uint64 numentries;
   /* buffer b; */
-  uint32 pos;
-  /* int fd; */
-  FILE * fp;
+  char *buf; /* CDB_WBUF bytes, CDB_ALIGN aligned */
+  unsigned int blen; /* bytes pending in buf */
+  uint64 boff; /* file offset of buf[0] */
+  uint64 reserved; /* bytes fallocate()d so far; ~0 once unsupported */
+  int direct; /* fd is in O_DIRECT mode */
+  uint64 pos; /* boff + blen */
+  unsigned int w; /* 4, or 8 for cdb64 */
+  uint32 flags; /* CDB_F_*, recorded in the trailer */
+  int threads; /* workers building hash tables in cdb_make_finish() */
+  unsigned int bloombits; /* CDB_S_BLOOM bits per record; 0 for none */
+  uint32 load; /* records per 65536 slots, at most 65536 */
+  /* set by cdb_make_finish(): */
+  uint64 slots; /* in all tables */
+  uint64 hitprobes; /* slots read finding each record once */
+  uint64 missprobes; /* slots read by a miss starting at each slot */
+  /* cdb_make_spill(): */
+  char *spillbuf; /* 256 CDB_SPILLBUF buffers, or 0 if not spilling */
+  unsigned int spilllen[256]; /* bytes pending in each */
+  int spillfd[256]; /* unlinked partition files of struct cdb_hp */
+  int unordered; /* pairs were not added in position order */
+  /* cdb_make_delete(): */
+  struct cdb_tomb *tomb;
+  uint64 ntombs, tombroom;
+  char *tombkeys;
+  uint64 tombkeylen, tombkeyroom;
+  int fd;
 } ;
 
-extern int cdb_make_start(struct cdb_make *, FILE *);
+extern int cdb_make_start(struct cdb_make *, int, uint32);
+extern int cdb_make_direct(struct cdb_make *);
+extern int cdb_make_spill(struct cdb_make *,const char *);
+extern int cdb_make_expect(struct cdb_make *,uint64);
 extern int cdb_make_addbegin(struct cdb_make *,unsigned int,unsigned int);
 extern int cdb_make_addend(struct cdb_make *,unsigned int,unsigned int,uint32);
 extern int cdb_make_add(struct cdb_make *,char *,unsigned int,char *,unsigned int);
+extern int cdb_make_load(struct cdb_make *,int,uint64 *);
+extern int cdb_make_merge(struct cdb_make *,struct cdb *,uint64 *,uint64);
+extern int cdb_make_delete(struct cdb_make *,char *,unsigned int);
 extern int cdb_make_finish(struct cdb_make *);
+extern int cdb_make_shardadd(struct cdb_make **,unsigned int,char *,unsigned int,char *,unsigned int);
+extern int cdb_make_shardfinish(struct cdb_make **,unsigned int,int);
+extern void cdb_make_free(struct cdb_make *);
 
 #endif
@@ -21,6 +21,9 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 #include <Python.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/resource.h>
 #include <fcntl.h>
 #include "cdb.h"
 #include "cdb_make.h"
@@ -28,11 +31,29 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 #define open_read(x)       (open((x),O_RDONLY|O_NDELAY))
 /* ala djb's open_foo */
 
+#ifndef EPROTO
+#define EPROTO -15  /* as in cdb.c */
+#endif
+
+#define ITERBUF     (1 << 20)  /* read buffer of iterators over unmapped cdbs */
+#define PROBEHIST   16         /* probe lengths 0..15 counted apart, then 16+ */
+
 #define VERSION     "0.35"
 #define CDBVERSION  "0.75"
 
 /* ------------------- cdb object -------------------- */
 
+/* lookup counters, kept only by cdb objects opened with stats=1 */
+struct cdbo_stats {
+    uint64 lookups;
+    uint64 hits;
+    uint64 misses;
+    uint64 probes;       /* hash slots read */
+    uint64 nomatch;      /* hash matched, key did not */
+    uint64 bytes;        /* value bytes returned */
+    uint64 hist[PROBEHIST + 1]; /* lookups by slots read */
+};
+
 static char cdbo_object_doc[] = "\
 This object represents a CDB database:  a reliable, constant\n\
 database mapping strings of bytes (\"keys\") to strings of bytes\n\
@@ -44,15 +65,24 @@ records under one key (though this feature is not often used).\n\
 A CDB object 'cdb_o' offers the following interesting attributes:\n\
 \n\
   Dict-like Lookup Methods:\n\
-    cdb_o[key], get(key), getnext(), getall(key)\n\
+    cdb_o[key], get(key), getnext(), getall(key), getmany(keys)\n\
 \n\
   Key-based Iteration Methods:\n\
-    keys(), firstkey(), nextkey()\n\
+    keys(), firstkey(), nextkey(), iterkeys(), iter(cdb_o)\n\
     (Key-based iteration returns only distinct keys.)\n\
 \n\
-  Raw Iteration Method:\n\
-    each()\n\
+  Raw Iteration Methods:\n\
+    each(), iteritems(), itervalues(), dump(f)\n\
     (\"Dumping\" may return the same key more than once.)\n\
+\n\
+  Table Statistics:\n\
+    tablecounts()\n\
+\n\
+  Page Cache:\n\
+    warm()\n\
+\n\
+  Lookup Statistics (cdb.init(..., stats=1)):\n\
+    stats(), resetstats()\n\
 \n\
   __members__:\n\
     fd   - File descriptor of the underlying cdb.\n\
@@ -61,18 +91,29 @@ A CDB object 'cdb_o' offers the following interesting attributes:\n\
 \n\
   __length__:\n\
     len(cdb_o) returns the total number of items in a cdb,\n\
-    which may or may not exceed the number of distinct keys.\n";
+    which may or may not exceed the number of distinct keys.\n\
+\n\
+Lookups release the GIL, so one cdb object may serve many threads\n\
+at once.  The getnext(), nextkey() and each() cursors belong to\n\
+the object, though, and are shared by all of its users.\n";
   
 
 typedef struct {
     PyObject_HEAD
     struct cdb c;
+    struct cdb_cursor k; /* getnext() position under getkey */
     PyObject * name_py;  /* 'filename' or Py_None */
     PyObject * getkey;   /* squirreled away for getnext() */
-    uint32 eod;          /* as in cdbdump */
-    uint32 iter_pos;
-    uint32 each_pos;
-    uint32 numrecords;
+    uint64 eod;          /* as in cdbdump */
+    uint64 iter_pos;
+    uint64 each_pos;
+    uint64 numrecords;
+    char zerocopy;       /* values as buffers into the map */
+    char have_repeats;   /* repeats below are initialized */
+    uint64 *repeats;     /* sorted positions of non-first records of a key */
+    uint64 nrepeats;
+    int scans;           /* iterators holding MADV_SEQUENTIAL on the map */
+    struct cdbo_stats *stats; /* NULL unless counting */
 } CdbObject;
 
 staticforward PyTypeObject CdbType;
@@ -81,7 +122,7 @@ PyObject * CDBError;
 #define CDBerr PyErr_SetFromErrno(CDBError)
 
 static PyObject *
-cdb_pyread(CdbObject *cdb_o, unsigned int len, uint32 pos) {
+cdb_pyread(CdbObject *cdb_o, uint64 len, uint64 pos) {
   struct cdb *c;
   PyObject *s = NULL;
 
@@ -92,23 +133,25 @@ cdb_pyread(CdbObject *cdb_o, unsigned int len, uint32 pos) {
       goto FORMAT;
     s = PyString_FromStringAndSize(c->map + pos, len);
   } else {
+    char * buf;
+
     s = PyString_FromStringAndSize(NULL, len);
     if (s == NULL)
       return NULL;
-    if (lseek(c->fd,pos,SEEK_SET) == -1) goto ERRNO;
+    buf = PyString_AsString(s);
     while (len > 0) {
-      int r;
-      char * buf = PyString_AsString(s);
+      ssize_t r;
 
       do {
         Py_BEGIN_ALLOW_THREADS
-        r = read(c->fd,buf,len);
+        r = pread(c->fd,buf,len,pos);
         Py_END_ALLOW_THREADS
       }
       while ((r == -1) && (errno == EINTR));
       if (r == -1) goto ERRNO;
       if (r == 0) goto FORMAT;
       buf += r;
+      pos += r;
       len -= r;
     }
   }
@@ -127,7 +170,70 @@ cdb_pyread(CdbObject *cdb_o, unsigned int len, uint32 pos) {
 }
 
 
-#define CDBO_CURDATA(x) (cdb_pyread(x, x->c.dlen, x->c.dpos))
+/*
+ * Values of a zerocopy cdb are read-only buffer objects over the map,
+ * which hold a reference to the cdb object and so keep it mapped.
+ */
+static PyObject *
+cdb_pyvalue(CdbObject *cdb_o, uint64 len, uint64 pos) {
+  struct cdb *c = &cdb_o->c;
+
+  if (!cdb_o->zerocopy || !c->map)
+    return cdb_pyread(cdb_o, len, pos);
+
+  if ((pos > c->size) || (c->size - pos < len)) {
+    errno = EPROTO;
+    return PyErr_SetFromErrno(PyExc_RuntimeError);
+  }
+  return PyBuffer_FromObject((PyObject *) cdb_o, pos, len);
+}
+
+#define CDBO_CURDATA(x, k) (cdb_pyvalue(x, (k)->dlen, (k)->dpos))
+
+/*
+ * Account for one lookup that read 'probes' slots.  Called with the
+ * GIL held; objects without stats pay only the test in CDBO_COUNT.
+ */
+static void
+_cdbo_count(CdbObject *self, uint64 probes, uint64 nomatch, int found,
+            uint64 bytes) {
+
+  struct cdbo_stats *s = self->stats;
+
+  s->lookups++;
+  if (found)
+    s->hits++;
+  else
+    s->misses++;
+  s->probes += probes;
+  s->nomatch += nomatch;
+  s->bytes += bytes;
+  s->hist[probes < PROBEHIST ? probes : PROBEHIST]++;
+}
+
+#define CDBO_COUNT(x, probes, nomatch, found, bytes) \
+  do { if ((x)->stats) _cdbo_count(x, probes, nomatch, found, bytes); } while (0)
+
+/* a lookup by one fresh cursor that ended in r */
+#define CDBO_COUNTK(x, k, r) \
+  CDBO_COUNT(x, (k)->loop, (k)->nomatch, (r) == 1, (r) == 1 ? (k)->dlen : 0)
+
+/*
+ * Lookups search with a cursor of their own and never write to the
+ * shared struct cdb, so they run with the GIL released and one cdb
+ * object can serve many threads at once.
+ */
+static int
+_cdbo_find(CdbObject *self, struct cdb_cursor *k, char *key, unsigned int klen) {
+
+  int r;
+
+  Py_BEGIN_ALLOW_THREADS
+  r = cdb_find(&self->c, k, key, klen);
+  Py_END_ALLOW_THREADS
+
+  return r;
+}
 
 
 /* ------------------- CdbObject methods -------------------- */
@@ -140,6 +246,7 @@ Returns true if the CDB contains key k.";
 static PyObject *
 cdbo_has_key(CdbObject *self, PyObject *args) {
 
+  struct cdb_cursor k;
   char * key;
   unsigned int klen;
   int r;
@@ -147,9 +254,10 @@ cdbo_has_key(CdbObject *self, PyObject *args) {
   if (!PyArg_ParseTuple(args, "s#", &key, &klen))
     return NULL;
 
-  r = cdb_find(&self->c, key, klen);
+  r = _cdbo_find(self, &k, key, klen);
   if (r == -1)
     return CDBerr;
+  CDBO_COUNT(self, k.loop, k.nomatch, r, 0);
 
   return Py_BuildValue("i", r);
 
@@ -170,6 +278,7 @@ the first record stored under key k:\n\
 static PyObject *
 cdbo_get(CdbObject *self, PyObject *args) {
 
+  struct cdb_cursor k;
   char * key;
   unsigned int klen;
   int r;
@@ -178,23 +287,29 @@ cdbo_get(CdbObject *self, PyObject *args) {
   if (!PyArg_ParseTuple(args, "s#|i:get", &key, &klen, &i))
     return NULL;
 
-  cdb_findstart(&self->c);
+  cdb_findstart(&k);
 
+  Py_BEGIN_ALLOW_THREADS
   for (;;) {
-    r = cdb_findnext(&self->c, key, klen);
-    if (r == -1) return CDBerr;
-    if (!r) return Py_BuildValue("");
+    r = cdb_findnext(&self->c, &k, key, klen);
+    if (r != 1) break;
     if (!i) break;
     --i;
   }
+  Py_END_ALLOW_THREADS
+
+  if (r == -1) return CDBerr;
+  CDBO_COUNTK(self, &k, r);
+  if (!r) return Py_BuildValue("");
 
   /* prep. possibly ensuing call to getnext() */
   Py_XDECREF(self->getkey);
   self->getkey = PyString_FromStringAndSize(key, klen);
   if (self->getkey == NULL)
     return NULL;
+  self->k = k;
 
-  return CDBO_CURDATA(self);
+  return CDBO_CURDATA(self, &k);
 }
 
 static char cdbo_getall_doc[] =
@@ -206,9 +321,11 @@ static PyObject *
 cdbo_getall(CdbObject *self, PyObject *args) {
 
   PyObject * list, * data;
+  struct cdb_cursor k;
   char * key;
   unsigned int klen;
   int r, err;
+  uint64 bytes = 0;
 
   if (!PyArg_ParseTuple(args, "s#:getall", &key, &klen))
     return NULL;
@@ -217,14 +334,14 @@ cdbo_getall(CdbObject *self, PyObject *args) {
 
   if (list == NULL) return NULL;
 
-  cdb_findstart(&self->c);
+  cdb_findstart(&k);
 
-  while ((r = cdb_findnext(&self->c, key, klen))) {
+  while ((r = cdb_findnext(&self->c, &k, key, klen))) {
     if (r == -1) {
       Py_DECREF(list);
       return CDBerr;
     }
-    data = CDBO_CURDATA(self);
+    data = CDBO_CURDATA(self, &k);
     if (data == NULL) {
       Py_DECREF(list);
       return NULL;
@@ -235,10 +352,90 @@ cdbo_getall(CdbObject *self, PyObject *args) {
       Py_DECREF(list);
       return NULL;
     }
+    bytes += k.dlen;
+  }
+  CDBO_COUNT(self, k.loop, k.nomatch, PyList_GET_SIZE(list) != 0, bytes);
+
+  return list;
+
+}
+
+static char cdbo_getmany_doc[] =
+"cdb_o.getmany(keys) -> ['data' or None, ... ]\n\
+\n\
+Fetch the first record stored under each key in the sequence keys,\n\
+with None standing in for missing keys.  On mmap()d files the\n\
+lookups are interleaved so their memory accesses overlap.";
+
+static PyObject *
+cdbo_getmany(CdbObject *self, PyObject *args) {
+
+  PyObject *keys, *seq, *list, *data;
+  struct cdb_batch *b;
+  Py_ssize_t n, i;
+  int r;
+
+  if (!PyArg_ParseTuple(args, "O:getmany", &keys))
+    return NULL;
+
+  /* a private tuple keeps every key alive while the GIL is released */
+  seq = PySequence_Tuple(keys);
+  if (seq == NULL)
+    return NULL;
+
+  n = PyTuple_GET_SIZE(seq);
+  b = PyMem_New(struct cdb_batch, n ? n : 1);
+  if (b == NULL) {
+    Py_DECREF(seq);
+    return PyErr_NoMemory();
+  }
+
+  for (i = 0; i < n; i++) {
+    PyObject *k = PyTuple_GET_ITEM(seq, i);
+    if (!PyString_Check(k)) {
+      PyErr_SetString(PyExc_TypeError, "keys must be strings");
+      goto FAIL;
+    }
+    b[i].key = PyString_AS_STRING(k);
+    b[i].len = PyString_GET_SIZE(k);
+  }
+
+  Py_BEGIN_ALLOW_THREADS
+  r = cdb_findmany(&self->c, b, n);
+  Py_END_ALLOW_THREADS
+
+  if (r == -1) {
+    CDBerr;
+    goto FAIL;
+  }
+
+  list = PyList_New(n);
+  if (list == NULL)
+    goto FAIL;
+
+  for (i = 0; i < n; i++) {
+    CDBO_COUNTK(self, &b[i].k, b[i].found);
+    if (b[i].found)
+      data = CDBO_CURDATA(self, &b[i].k);
+    else {
+      Py_INCREF(Py_None);
+      data = Py_None;
+    }
+    if (data == NULL) {
+      Py_DECREF(list);
+      goto FAIL;
+    }
+    PyList_SET_ITEM(list, i, data);
   }
 
+  PyMem_Free(b);
+  Py_DECREF(seq);
   return list;
 
+  FAIL:
+  PyMem_Free(b);
+  Py_DECREF(seq);
+  return NULL;
 }
 
 static char cdbo_getnext_doc[] =
@@ -259,6 +456,9 @@ The following loops through all items stored under key k:\n\
 static PyObject *
 cdbo_getnext(CdbObject *self, PyObject *args) {
 
+  uint64 loop, nomatch;
+  int r;
+
   if (!PyArg_ParseTuple(args, ":getnext"))
     return NULL;
 
@@ -268,9 +468,16 @@ cdbo_getnext(CdbObject *self, PyObject *args) {
     return NULL;
   }
 
-  switch(cdb_findnext(&self->c, 
-                      PyString_AsString(self->getkey), 
-                      PyString_Size(self->getkey))) {
+  loop = self->k.loop;
+  nomatch = self->k.nomatch;
+  r = cdb_findnext(&self->c, &self->k,
+                   PyString_AsString(self->getkey),
+                   PyString_Size(self->getkey));
+  if (r != -1)
+    CDBO_COUNT(self, self->k.loop - loop, self->k.nomatch - nomatch, r,
+               r == 1 ? self->k.dlen : 0);
+
+  switch (r) {
     case -1:
       return CDBerr;
     case  0:
@@ -278,32 +485,76 @@ cdbo_getnext(CdbObject *self, PyObject *args) {
       self->getkey = NULL;
       return Py_BuildValue("");
     default:
-      return CDBO_CURDATA(self);
+      return CDBO_CURDATA(self, &self->k);
   }
  /* not reached */
 }
 
-uint32
+uint64
 _cdbo_init_eod(CdbObject *self) {
 
-  char nonce[4];
+  char nonce[8];
 
-  if (cdb_read(&self->c, nonce, 4, 0) == -1)
+  if (cdb_read(&self->c, nonce, self->c.w, 0) == -1)
     return 0;
 
-  uint32_unpack(nonce, &self->eod);
+  self->eod = cdb_unpackw(nonce, self->c.w);
 
   return self->eod;
 
 }
 
+/*
+ * positions of records that repeat an earlier key, found on first use;
+ * threads may race to find them, and the first to get the GIL back
+ * with them wins
+ */
+static int
+_cdbo_init_repeats(CdbObject *self) {
+
+  uint64 *repeats = NULL;
+  uint64 nrepeats = 0;
+  int r;
+
+  if (self->have_repeats)
+    return 0;
+
+  Py_BEGIN_ALLOW_THREADS
+  r = cdb_repeats(&self->c, &repeats, &nrepeats);
+  Py_END_ALLOW_THREADS
+
+  if (r == -1)
+    return -1;
+  if (self->have_repeats) {
+    free(repeats);
+    return 0;
+  }
+  self->repeats = repeats;
+  self->nrepeats = nrepeats;
+  self->have_repeats = 1;
+  return 0;
+}
+
+static int
+_cdbo_is_repeat(CdbObject *self, uint64 pos) {
+
+  uint64 lo = 0, hi = self->nrepeats, mid;
+
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (self->repeats[mid] == pos) return 1;
+    if (self->repeats[mid] < pos) lo = mid + 1;
+    else hi = mid;
+  }
+  return 0;
+}
+
 /*
  * _cdbo_keyiter(cdb_o)
  *
  * Whiz-bang all-in-one:
- *   extract current record
- *   compare current pos to pos implied by cdb_find(current_key)
- *     (Different? adv. iter cursor, loop and try again)
+ *   skip records whose key appeared earlier (see cdb_repeats())
+ *   extract current record's key
  *   advance iteration cursor
  *   return key
  */
@@ -311,48 +562,28 @@ _cdbo_init_eod(CdbObject *self) {
 static PyObject *
 _cdbo_keyiter(CdbObject *self) {
 
-  PyObject *key;
-  char buf[8];
-  uint32 klen, dlen;
+  char buf[16];
+  unsigned int w = self->c.w;
+  uint64 klen, dlen, pos;
 
   if (! self->eod)
     _cdbo_init_eod(self);
 
+  if (_cdbo_init_repeats(self) == -1)
+    return CDBerr;
+
   while (self->iter_pos < self->eod) {
-    if (cdb_read(&self->c, buf, 8, self->iter_pos) == -1)
+    if (cdb_read(&self->c, buf, w + w, self->iter_pos) == -1)
       return CDBerr;
 
-    uint32_unpack(buf, &klen);
-    uint32_unpack(buf+4, &dlen);
-
-    key = cdb_pyread(self, klen, self->iter_pos + 8);
-
-    if (key == NULL)
-      return NULL;
+    klen = cdb_unpackw(buf, w);
+    dlen = cdb_unpackw(buf + w, w);
 
-    switch(cdb_find(&self->c,PyString_AsString(key),PyString_Size(key))) {
-      case -1:
-        Py_DECREF(key);
-        key = NULL;
-        return CDBerr;
-      case 0:
-        /* bizarre, impossible? PyExc_RuntimeError? */
-        PyErr_SetString(PyExc_KeyError, 
-                        PyString_AS_STRING((PyStringObject *) key));
-        Py_DECREF(key);
-        key = NULL;
-      default:
-        if (key == NULL)  /* already raised error */
-          return NULL;
+    pos = self->iter_pos;
+    self->iter_pos += w + w + klen + dlen;
 
-        if (cdb_datapos(&self->c) == self->iter_pos + klen + 8) {
-          /** first occurrence of key in the cdb **/
-          self->iter_pos += 8 + klen + dlen;
-          return key;
-        }
-        Py_DECREF(key);   /* better luck next time around */
-        self->iter_pos += 8 + klen + dlen;
-    }
+    if (! _cdbo_is_repeat(self, pos))
+      return cdb_pyread(self, klen, pos + w + w);
   }
 
   return Py_BuildValue("");  /* iter_pos >= eod; we're done */
@@ -368,7 +599,7 @@ static PyObject *
 cdbo_keys(CdbObject *self, PyObject *args) {
 
   PyObject *r, *key;
-  uint32 pos;
+  uint64 pos;
   int err;
 
   if (! PyArg_ParseTuple(args, ""))
@@ -380,10 +611,15 @@ cdbo_keys(CdbObject *self, PyObject *args) {
 
   pos = self->iter_pos;  /* don't interrupt a manual iteration */
 
-  self->iter_pos = 2048;
+  self->iter_pos = cdb_hdrsize(&self->c);
 
   key = _cdbo_keyiter(self);
   while (key != Py_None) {
+    if (key == NULL) {
+      Py_DECREF(r);
+      self->iter_pos = pos;
+      return NULL;
+    }
     err = PyList_Append(r, key);
     Py_DECREF(key);
     if (err != 0) {
@@ -415,7 +651,7 @@ cdbo_firstkey(CdbObject *self, PyObject *args) {
   if (! PyArg_ParseTuple(args, ":firstkey"))
     return NULL;
 
-  self->iter_pos = 2048;
+  self->iter_pos = cdb_hdrsize(&self->c);
 
   return _cdbo_keyiter(self);
 
@@ -459,8 +695,9 @@ static PyObject *
 cdbo_each(CdbObject *self, PyObject *args) {
 
   PyObject *tup, *key, *dat;
-  char buf[8];
-  uint32 klen, dlen;
+  char buf[16];
+  unsigned int w = self->c.w;
+  uint64 klen, dlen;
 
   if (! PyArg_ParseTuple(args, ":each"))
     return NULL;
@@ -473,21 +710,21 @@ cdbo_each(CdbObject *self, PyObject *args) {
     (void) _cdbo_init_eod(self);
 
   if (self->each_pos >= self->eod) { /* all done, reset cursor */
-    self->each_pos = 2048;
+    self->each_pos = cdb_hdrsize(&self->c);
     Py_INCREF(Py_None);
     return Py_None;
   }
 
-  if (cdb_read(&self->c, buf, 8, self->each_pos) == -1)
+  if (cdb_read(&self->c, buf, w + w, self->each_pos) == -1)
     return CDBerr;
 
-  uint32_unpack(buf, &klen);
-  uint32_unpack(buf+4, &dlen);
+  klen = cdb_unpackw(buf, w);
+  dlen = cdb_unpackw(buf + w, w);
 
-  key = cdb_pyread(self, klen, self->each_pos + 8);
-  dat = cdb_pyread(self, dlen, self->each_pos + 8 + klen);
+  key = cdb_pyread(self, klen, self->each_pos + w + w);
+  dat = cdb_pyvalue(self, dlen, self->each_pos + w + w + klen);
 
-  self->each_pos += klen + dlen + 8;
+  self->each_pos += klen + dlen + w + w;
 
   if (key == NULL || dat == NULL) {
     Py_XDECREF(key); Py_XDECREF(dat);
@@ -503,227 +740,1942 @@ cdbo_each(CdbObject *self, PyObject *args) {
   return tup;
 }
 
-/*** cdb object as mapping ***/
-
-static int
-cdbo_length(CdbObject *self) {
-
-  if (! self->numrecords) {
-    char buf[8];
-    uint32 pos, klen, dlen;
+static char cdbo_tablecounts_doc[] =
+"cdb_o.tablecounts() -> [n0, n1, ... n255]\n\
+\n\
+Returns the number of records in each of the 256 hash tables, read\n\
+from the header without touching the data.  They sum to len(cdb_o).";
 
-    pos = 2048;
+static PyObject *
+cdbo_tablecounts(CdbObject *self, PyObject *args) {
 
-    if (! self->eod)
-      (void) _cdbo_init_eod(self);
+  PyObject *r, *n;
+  uint64 counts[256];
+  int i;
 
-    while (pos < self->eod) {
-      if (cdb_read(&self->c, buf, 8, pos) == -1)
-        return -1;
-      uint32_unpack(buf, &klen);
-      uint32_unpack(buf + 4, &dlen);
-      pos += 8 + klen + dlen;
-      self->numrecords++;
-    }
-  }
-  return (int) self->numrecords;
-}
+  if (! PyArg_ParseTuple(args, ":tablecounts"))
+    return NULL;
 
-static PyObject *
-cdbo_subscript(CdbObject *self, PyObject *k) {
-  char * key;
-  int klen;
+  if (cdb_counts(&self->c, counts) == -1)
+    return CDBerr;
 
-  if (! PyArg_Parse(k, "s#", &key, &klen))
+  r = PyList_New(256);
+  if (r == NULL)
     return NULL;
 
-  switch(cdb_find(&self->c, key, (unsigned int)klen)) {
-    case -1:
-      return CDBerr;
-    case 0:
-      PyErr_SetString(PyExc_KeyError, 
-                      PyString_AS_STRING((PyStringObject *) k));
+  for (i = 0; i < 256; i++) {
+    n = PyLong_FromUnsignedLongLong(counts[i]);
+    if (n == NULL) {
+      Py_DECREF(r);
       return NULL;
-    default:
-      return CDBO_CURDATA(self);
+    }
+    PyList_SET_ITEM(r, i, n);
   }
-  /* not reached */
-}
-
-static PyMappingMethods cdbo_as_mapping = {
-	(inquiry)cdbo_length,
-	(binaryfunc)cdbo_subscript,
-	(objobjargproc)0
-};
 
-static PyMethodDef cdb_methods[] = { 
-
-  {"get",      (PyCFunction)cdbo_get,      METH_VARARGS,
-               cdbo_get_doc },
-  {"getnext",  (PyCFunction)cdbo_getnext,  METH_VARARGS,
-               cdbo_getnext_doc },
-  {"getall",   (PyCFunction)cdbo_getall,   METH_VARARGS,
-               cdbo_getall_doc },
-  {"has_key",  (PyCFunction)cdbo_has_key,  METH_VARARGS, 
-               cdbo_has_key_doc },
-  {"keys",     (PyCFunction)cdbo_keys,     METH_VARARGS,
-               cdbo_keys_doc },
-  {"firstkey", (PyCFunction)cdbo_firstkey, METH_VARARGS,
-               cdbo_firstkey_doc },
-  {"nextkey",  (PyCFunction)cdbo_nextkey,  METH_VARARGS,
-               cdbo_nextkey_doc },
-  {"each",     (PyCFunction)cdbo_each, METH_VARARGS,
-               cdbo_each_doc },
-  { NULL,    NULL }
-};
+  return r;
+}
 
-/* ------------------- cdb operations -------------------- */
+static char cdbo_warm_doc[] =
+"cdb_o.warm() -> int\n\
+\n\
+Read the hash tables into the page cache ahead of the first\n\
+lookups, leaving the records themselves alone, and return the\n\
+number of bytes covered.  Useful straight after opening a cdb\n\
+with advice='random', which otherwise faults the tables in one\n\
+page at a time.";
 
 static PyObject *
-_wrap_cdb_init(int fd) {  /* constructor implementation */
+cdbo_warm(CdbObject *self, PyObject *args) {
 
-  CdbObject *self;
+  uint64 warmed;
+  int r;
 
-  self = PyObject_NEW(CdbObject, &CdbType);
-  if (self == NULL) return NULL;
+  if (! PyArg_ParseTuple(args, ":warm"))
+    return NULL;
 
-  self->c.map = 0; /* break encapsulation -- cdb struct init'd to zero */
-  cdb_init(&self->c, fd);
+  Py_BEGIN_ALLOW_THREADS
+  r = cdb_warm(&self->c, &warmed);
+  Py_END_ALLOW_THREADS
 
-  self->iter_pos   = 2048;
-  self->each_pos   = 2048;
-  self->numrecords = 0;
-  self->eod        = 0;
-  self->getkey     = NULL;
+  if (r == -1)
+    return CDBerr;
 
-  return (PyObject *) self;
+  return PyLong_FromUnsignedLongLong(warmed);
 }
 
+static char cdbo_dump_doc[] =
+"cdb_o.dump(f [, format]) -> None\n\
+\n\
+Write every record to f, a file descriptor or file object, at its\n\
+current position.  format is 'cdbdump' (the default), the text\n\
+that cdbdump prints and cdbmake and cdbmake.addfile() read, or\n\
+'raw', the records exactly as the file stores them: for each, the\n\
+key and data lengths as little-endian integers of 4 bytes (8 for\n\
+cdb64), then the key and data.  The work is done in C without the\n\
+GIL, and raw output is copied within the kernel where possible.";
 
 static PyObject *
-cdbo_constructor(PyObject *ignore, PyObject *args) {
+cdbo_dump(CdbObject *self, PyObject *args, PyObject *kwds) {
 
-  PyObject *self;
+  static char *kwlist[] = {"f", "format", NULL};
   PyObject *f;
-  PyObject *name_attr = Py_None;
-  int fd;
+  char *format = "cdbdump";
+  int fd, how, r;
 
-  if (! PyArg_ParseTuple(args, "O:new", &f))
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|s:dump", kwlist,
+                                   &f, &format))
     return NULL;
 
-  if (PyString_Check(f)) {
+  if (strcmp(format, "cdbdump") == 0)
+    how = CDB_DUMP_TEXT;
+  else if (strcmp(format, "raw") == 0)
+    how = CDB_DUMP_RAW;
+  else {
+    PyErr_SetString(PyExc_ValueError, "format must be 'cdbdump' or 'raw'");
+    return NULL;
+  }
 
-    if ((fd = open_read(PyString_AsString(f))) == -1)
-      return CDBerr;
+  /* anything still buffered in a file object goes first */
+  if (PyFile_Check(f) && fflush(PyFile_AsFile(f)) == EOF)
+    return PyErr_SetFromErrno(PyExc_IOError);
+  if ((fd = PyObject_AsFileDescriptor(f)) == -1)
+    return NULL;
 
-    name_attr = f;
+  Py_BEGIN_ALLOW_THREADS
+  r = cdb_dump(&self->c, fd, how);
+  Py_END_ALLOW_THREADS
 
-  } else if (PyInt_Check(f)) {
+  if (r == -1)
+    return CDBerr;
 
-    fd = (int) PyInt_AsLong(f);
+  return Py_BuildValue("");
+}
 
-  } else {
+static char cdbo_stats_doc[] =
+"cdb_o.stats() -> dict (or None)\n\
+\n\
+Lookup counters of a cdb opened with stats=1, None otherwise:\n\
+\n\
+  lookups, hits, misses - has_key(), get(), getnext(), getall(),\n\
+                          cdb_o[k] and each key of getmany()\n\
+  probes  - hash slots read, in all\n\
+  nomatch - records whose hash matched but whose key did not\n\
+  bytes   - value bytes returned\n\
+  probe_lengths - probe_lengths[i] lookups read i slots; the last\n\
+                  entry counts the longer ones\n\
+\n\
+Long probes on a file with few records per table point at skewed\n\
+tables; many nomatches point at hash collisions.";
 
-    PyErr_SetString(PyExc_TypeError,
-                    "expected filename or file descriptor");
+static PyObject *
+cdbo_stats(CdbObject *self, PyObject *args) {
+
+  struct cdbo_stats *s = self->stats;
+  PyObject *hist, *n;
+  int i;
+
+  if (! PyArg_ParseTuple(args, ":stats"))
     return NULL;
 
+  if (s == NULL)
+    return Py_BuildValue("");
+
+  hist = PyList_New(PROBEHIST + 1);
+  if (hist == NULL)
+    return NULL;
+  for (i = 0; i <= PROBEHIST; i++) {
+    n = PyLong_FromUnsignedLongLong(s->hist[i]);
+    if (n == NULL) {
+      Py_DECREF(hist);
+      return NULL;
+    }
+    PyList_SET_ITEM(hist, i, n);
   }
 
-  self = _wrap_cdb_init(fd);
-  if (self == NULL) return NULL;
+  return Py_BuildValue("{sKsKsKsKsKsKsN}",
+                       "lookups", s->lookups,
+                       "hits", s->hits,
+                       "misses", s->misses,
+                       "probes", s->probes,
+                       "nomatch", s->nomatch,
+                       "bytes", s->bytes,
+                       "probe_lengths", hist);
+}
 
-  ((CdbObject *)self)->name_py = name_attr;
-  Py_INCREF(name_attr);
+static char cdbo_resetstats_doc[] =
+"cdb_o.resetstats() -> None\n\
+\n\
+Zero the counters reported by stats().";
 
-  return self;
-}
+static PyObject *
+cdbo_resetstats(CdbObject *self, PyObject *args) {
 
-static void
-cdbo_dealloc(CdbObject *self) {  /* del(cdb_o) */
+  if (! PyArg_ParseTuple(args, ":resetstats"))
+    return NULL;
 
-  if (self->name_py != NULL) {
+  if (self->stats != NULL)
+    memset(self->stats, 0, sizeof *self->stats);
 
-    /* if cdb_o.name is not None:  we open()d it ourselves, so close it */
-    if (PyString_Check(self->name_py))
-      close(self->c.fd);
+  return Py_BuildValue("");
+}
 
-    Py_DECREF(self->name_py);
-  }
+/*** cdb object as mapping ***/
 
-  Py_XDECREF(self->getkey);
+static Py_ssize_t
+cdbo_length(CdbObject *self) {
 
-  cdb_free(&self->c);
+  if (! self->numrecords) {
+    uint64 counts[256];
+    int i;
 
-  PyObject_DEL(self);
+    if (cdb_counts(&self->c, counts) == -1) {
+      CDBerr;
+      return -1;
+    }
+    for (i = 0; i < 256; i++)
+      self->numrecords += counts[i];
+  }
+  return (Py_ssize_t) self->numrecords;
 }
 
 static PyObject *
-cdbo_getattr(CdbObject *self, char *name) {
+cdbo_subscript(CdbObject *self, PyObject *k) {
+  struct cdb_cursor cur;
+  char * key;
+  int klen;
+  int r;
 
-  PyObject * r;
+  if (! PyArg_Parse(k, "s#", &key, &klen))
+    return NULL;
 
-  r = Py_FindMethod(cdb_methods, (PyObject *) self, name);
+  r = _cdbo_find(self, &cur, key, (unsigned int)klen);
+  if (r != -1)
+    CDBO_COUNTK(self, &cur, r);
 
-  if (r != NULL)
-    return r;
+  switch(r) {
+    case -1:
+      return CDBerr;
+    case 0:
+      PyErr_SetString(PyExc_KeyError, 
+                      PyString_AS_STRING((PyStringObject *) k));
+      return NULL;
+    default:
+      return CDBO_CURDATA(self, &cur);
+  }
+  /* not reached */
+}
 
-  PyErr_Clear();
+/* ------------------- cdb iterator object -------------------- */
 
-  if (!strcmp(name,"__members__"))
-    return Py_BuildValue("[sss]", "fd", "name", "size");
+/*
+ * Iterators scan the records in file order.  Over a map they advise
+ * the kernel of the sequential scan; otherwise they read the file in
+ * ITERBUF-sized blocks, going to the file directly only for records
+ * larger than that.
+ */
 
-  if (!strcmp(name,"fd")) {
-    return Py_BuildValue("i", self->c.fd);  /* cdb_o.fd */
+#define CDBI_KEYS   0
+#define CDBI_VALUES 1
+#define CDBI_ITEMS  2
+
+typedef struct {
+    PyObject_HEAD
+    PyObject * layers;   /* tuple of cdb objects, newest first */
+    struct cdb ** c;     /* their struct cdbs, in the same order */
+    unsigned int n;
+    char sharded;        /* layers are the shards of a set, not a stack */
+} CdbStackObject;
+
+/* where the stack or sharded set finds key: as cdb_stackfind() */
+#define _cdbs_locate(self, layer, k, key, klen) \
+  ((self)->sharded ? \
+   cdb_shardfind((self)->c, (self)->n, (layer), (k), (key), (klen)) : \
+   cdb_stackfind((self)->c, (self)->n, (layer), (k), (key), (klen)))
+
+typedef struct {
+    PyObject_HEAD
+    CdbObject * owner;
+    int kind;            /* CDBI_KEYS, CDBI_VALUES or CDBI_ITEMS */
+    uint64 pos;          /* next record */
+    uint64 eod;
+    char * buf;          /* ITERBUF bytes, unmapped cdbs only */
+    uint64 boff;         /* file offset of buf[0] */
+    uint64 blen;         /* valid bytes in buf */
+    char sequential;     /* counted in owner->scans */
+    CdbStackObject * stack; /* if not NULL, owner is its layer-th layer */
+    char filter;         /* yield only what a lookup in stack would find */
+    unsigned int layer;
+} CdbIterObject;
+
+staticforward PyTypeObject CdbIterType;
+
+static void
+_cdbi_release(CdbIterObject *it) {
+
+  struct cdb *c;
+
+  if (it->sequential) {
+    c = &it->owner->c;
+    it->sequential = 0;
+    if (--it->owner->scans == 0)
+      madvise(c->map, it->eod,
+              (c->how & CDB_MAP_RANDOM) ? MADV_RANDOM : MADV_NORMAL);
+  }
+}
+
+/* point *p at len bytes of the file at pos; 1 if too long to buffer */
+static int
+_cdbi_window(CdbIterObject *it, uint64 pos, uint64 len, char **p) {
+
+  struct cdb *c = &it->owner->c;
+  uint64 n;
+  ssize_t r;
+
+  if ((pos > c->size) || (c->size - pos < len)) {
+    errno = EPROTO;
+    PyErr_SetFromErrno(PyExc_RuntimeError);
+    return -1;
+  }
+
+  if (c->map) {
+    *p = c->map + pos;
+    return 0;
+  }
+
+  if ((pos < it->boff) || (pos + len > it->boff + it->blen)) {
+    if (len > ITERBUF)
+      return 1;
+    it->boff = pos;
+    it->blen = 0;
+    n = c->size - pos;
+    if (n > ITERBUF) n = ITERBUF;
+    while (it->blen < n) {
+      do
+        r = pread(c->fd, it->buf + it->blen, n - it->blen, pos + it->blen);
+      while ((r == -1) && (errno == EINTR));
+      if (r == -1) {
+        CDBerr;
+        return -1;
+      }
+      if (r == 0) break;
+      it->blen += r;
+    }
+    if (it->blen < len) {
+      errno = EPROTO;
+      PyErr_SetFromErrno(PyExc_RuntimeError);
+      return -1;
+    }
+  }
+
+  *p = it->buf + (pos - it->boff);
+  return 0;
+}
+
+static PyObject *
+_cdbi_string(CdbIterObject *it, uint64 len, uint64 pos) {
+
+  char *p;
+
+  if (it->owner->c.map)
+    return cdb_pyread(it->owner, len, pos);
+
+  switch (_cdbi_window(it, pos, len, &p)) {
+    case -1:
+      return NULL;
+    case 1:
+      return cdb_pyread(it->owner, len, pos);
+    default:
+      return PyString_FromStringAndSize(p, len);
+  }
+}
+
+/* point it at the start of owner's records, taking a reference to owner */
+static int
+_cdbi_start(CdbIterObject *it, CdbObject *owner) {
+
+  if (! owner->eod)
+    _cdbo_init_eod(owner);
+
+  if ((it->kind == CDBI_KEYS) && ! it->filter &&
+      (_cdbo_init_repeats(owner) == -1)) {
+    CDBerr;
+    return -1;
+  }
+
+  Py_INCREF(owner);
+  Py_XDECREF(it->owner);
+  it->owner = owner;
+  it->pos = cdb_hdrsize(&owner->c);
+  it->eod = owner->eod;
+  it->boff = 0;
+  it->blen = 0;
+  it->sequential = 0;
+
+  if (owner->c.map) {
+    if (owner->scans++ == 0)
+      (void) madvise(owner->c.map, it->eod, MADV_SEQUENTIAL);
+    it->sequential = 1;
+  } else if (it->buf == NULL) {
+    it->buf = PyMem_Malloc(ITERBUF);
+    if (it->buf == NULL) {
+      PyErr_NoMemory();
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * 1 if the record at pos, with a key of klen bytes, is the one the
+ * iterator's stack finds under its key: the key is neither in a newer
+ * layer nor deleted by one, and no earlier record in this layer has it.
+ */
+static int
+_cdbi_visible(CdbIterObject *it, uint64 pos, uint64 klen) {
+
+  CdbStackObject *st = it->stack;
+  struct cdb_cursor k;
+  PyObject *key = NULL;
+  char *p;
+  unsigned int layer;
+  int r;
+
+  pos += it->owner->c.w * 2;
+  switch (_cdbi_window(it, pos, klen, &p)) {
+    case -1:
+      return -1;
+    case 1:
+      if ((key = cdb_pyread(it->owner, klen, pos)) == NULL)
+        return -1;
+      p = PyString_AS_STRING(key);
+  }
+
+  r = _cdbs_locate(st, &layer, &k, p, (unsigned int) klen);
+  Py_XDECREF(key);
+  if (r == -1) {
+    CDBerr;
+    return -1;
+  }
+  return (r == 1) && (layer == it->layer) && (k.dpos == pos + klen);
+}
+
+static PyObject *
+cdbi_iternext(CdbIterObject *it) {
+
+  CdbObject *self = it->owner;
+  unsigned int w = self->c.w;
+  PyObject *key = NULL, *val = NULL, *r;
+  char *p;
+  uint64 klen, dlen, pos;
+
+  for (;;) {
+    if (it->pos >= it->eod) {
+      _cdbi_release(it);
+      if (! it->stack || (it->layer + 1 == it->stack->n))
+        return NULL;
+      it->layer++;
+      if (_cdbi_start(it, (CdbObject *)
+                      PyTuple_GET_ITEM(it->stack->layers, it->layer)) == -1)
+        return NULL;
+      self = it->owner;
+      w = self->c.w;
+      continue;
+    }
+    if (_cdbi_window(it, it->pos, w + w, &p) == -1)
+      return NULL;
+    klen = cdb_unpackw(p, w);
+    dlen = cdb_unpackw(p + w, w);
+    pos = it->pos;
+    it->pos += w + w + klen + dlen;
+    if (it->filter) {
+      switch (_cdbi_visible(it, pos, klen)) {
+        case -1:
+          return NULL;
+        case 1:
+          goto FOUND;
+      }
+      continue;
+    }
+    if ((it->kind != CDBI_KEYS) || ! _cdbo_is_repeat(self, pos))
+      break;
+  }
+  FOUND:
+
+  if (it->kind != CDBI_VALUES) {
+    key = _cdbi_string(it, klen, pos + w + w);
+    if ((key == NULL) || (it->kind == CDBI_KEYS))
+      return key;
+  }
+
+  if (self->zerocopy && self->c.map)
+    val = cdb_pyvalue(self, dlen, pos + w + w + klen);
+  else
+    val = _cdbi_string(it, dlen, pos + w + w + klen);
+  if ((val == NULL) || (it->kind == CDBI_VALUES)) {
+    Py_XDECREF(key);
+    return val;
+  }
+
+  r = PyTuple_Pack(2, key, val);
+  Py_DECREF(key);
+  Py_DECREF(val);
+  return r;
+}
+
+static void
+cdbi_dealloc(CdbIterObject *it) {
+
+  _cdbi_release(it);
+  PyMem_Free(it->buf);
+  Py_XDECREF(it->owner);
+  Py_XDECREF(it->stack);
+  PyObject_DEL(it);
+}
+
+static PyObject *
+_cdbo_iter(CdbObject *self, int kind) {
+
+  CdbIterObject *it;
+
+  it = PyObject_NEW(CdbIterObject, &CdbIterType);
+  if (it == NULL)
+    return NULL;
+
+  it->owner = NULL;
+  it->kind = kind;
+  it->buf = NULL;
+  it->sequential = 0;
+  it->stack = NULL;
+  it->filter = 0;
+  it->layer = 0;
+
+  if (_cdbi_start(it, self) == -1) {
+    Py_DECREF(it);
+    return NULL;
+  }
+
+  return (PyObject *) it;
+}
+
+static PyObject *
+cdbo_iter(CdbObject *self) {
+  return _cdbo_iter(self, CDBI_KEYS);
+}
+
+static char cdbo_iterkeys_doc[] =
+"cdb_o.iterkeys() -> iterator\n\
+\n\
+Iterate over the distinct keys, as keys() does.  iter(cdb_o) is the\n\
+same.";
+
+static PyObject *
+cdbo_iterkeys(CdbObject *self, PyObject *args) {
+
+  if (! PyArg_ParseTuple(args, ":iterkeys"))
+    return NULL;
+
+  return _cdbo_iter(self, CDBI_KEYS);
+}
+
+static char cdbo_itervalues_doc[] =
+"cdb_o.itervalues() -> iterator\n\
+\n\
+Iterate over the data of every record, in file order.";
+
+static PyObject *
+cdbo_itervalues(CdbObject *self, PyObject *args) {
+
+  if (! PyArg_ParseTuple(args, ":itervalues"))
+    return NULL;
+
+  return _cdbo_iter(self, CDBI_VALUES);
+}
+
+static char cdbo_iteritems_doc[] =
+"cdb_o.iteritems() -> iterator\n\
+\n\
+Iterate over the (key, data) pair of every record, in file order, as\n\
+each() does.  Unlike each(), iterators are independent of each\n\
+other and of the cdb object's own cursors.";
+
+static PyObject *
+cdbo_iteritems(CdbObject *self, PyObject *args) {
+
+  if (! PyArg_ParseTuple(args, ":iteritems"))
+    return NULL;
+
+  return _cdbo_iter(self, CDBI_ITEMS);
+}
+
+/*** cdb object as (read-only) buffer over its map ***/
+
+static Py_ssize_t
+cdbo_getreadbuf(CdbObject *self, Py_ssize_t segment, void **ptr) {
+
+  if (segment != 0) {
+    PyErr_SetString(PyExc_SystemError, "accessing non-existent segment");
+    return -1;
+  }
+  if (!self->c.map) {
+    PyErr_SetString(PyExc_TypeError, "cdb is not mmap()d");
+    return -1;
+  }
+  *ptr = self->c.map;
+  return (Py_ssize_t) self->c.size;
+}
+
+static Py_ssize_t
+cdbo_getsegcount(CdbObject *self, Py_ssize_t *lenp) {
+
+  if (lenp)
+    *lenp = self->c.map ? (Py_ssize_t) self->c.size : 0;
+  return 1;
+}
+
+static PyBufferProcs cdbo_as_buffer = {
+	(readbufferproc)cdbo_getreadbuf,
+	(writebufferproc)0,
+	(segcountproc)cdbo_getsegcount,
+	(charbufferproc)0
+};
+
+/* k in cdb_o: a lookup, as has_key(), rather than a scan by iter() */
+static int
+cdbo_contains(CdbObject *self, PyObject *k) {
+
+  struct cdb_cursor cur;
+  char * key;
+  int klen;
+  int r;
+
+  if (! PyArg_Parse(k, "s#", &key, &klen))
+    return -1;
+
+  r = _cdbo_find(self, &cur, key, (unsigned int)klen);
+  if (r == -1) {
+    CDBerr;
+    return -1;
+  }
+  CDBO_COUNT(self, cur.loop, cur.nomatch, r, 0);
+
+  return r;
+}
+
+static PySequenceMethods cdbo_as_sequence = {
+	(lenfunc)0,                   /* sq_length */
+	(binaryfunc)0,                /* sq_concat */
+	(ssizeargfunc)0,              /* sq_repeat */
+	(ssizeargfunc)0,              /* sq_item */
+	(ssizessizeargfunc)0,         /* sq_slice */
+	(ssizeobjargproc)0,           /* sq_ass_item */
+	(ssizessizeobjargproc)0,      /* sq_ass_slice */
+	(objobjproc)cdbo_contains,    /* sq_contains */
+};
+
+static PyMappingMethods cdbo_as_mapping = {
+	(lenfunc)cdbo_length,
+	(binaryfunc)cdbo_subscript,
+	(objobjargproc)0
+};
+
+static PyMethodDef cdb_methods[] = { 
+
+  {"get",      (PyCFunction)cdbo_get,      METH_VARARGS,
+               cdbo_get_doc },
+  {"getnext",  (PyCFunction)cdbo_getnext,  METH_VARARGS,
+               cdbo_getnext_doc },
+  {"getall",   (PyCFunction)cdbo_getall,   METH_VARARGS,
+               cdbo_getall_doc },
+  {"getmany",  (PyCFunction)cdbo_getmany,  METH_VARARGS,
+               cdbo_getmany_doc },
+  {"has_key",  (PyCFunction)cdbo_has_key,  METH_VARARGS, 
+               cdbo_has_key_doc },
+  {"keys",     (PyCFunction)cdbo_keys,     METH_VARARGS,
+               cdbo_keys_doc },
+  {"firstkey", (PyCFunction)cdbo_firstkey, METH_VARARGS,
+               cdbo_firstkey_doc },
+  {"nextkey",  (PyCFunction)cdbo_nextkey,  METH_VARARGS,
+               cdbo_nextkey_doc },
+  {"each",     (PyCFunction)cdbo_each, METH_VARARGS,
+               cdbo_each_doc },
+  {"iterkeys", (PyCFunction)cdbo_iterkeys, METH_VARARGS,
+               cdbo_iterkeys_doc },
+  {"itervalues", (PyCFunction)cdbo_itervalues, METH_VARARGS,
+               cdbo_itervalues_doc },
+  {"iteritems", (PyCFunction)cdbo_iteritems, METH_VARARGS,
+               cdbo_iteritems_doc },
+  {"tablecounts", (PyCFunction)cdbo_tablecounts, METH_VARARGS,
+               cdbo_tablecounts_doc },
+  {"warm",     (PyCFunction)cdbo_warm,     METH_VARARGS,
+               cdbo_warm_doc },
+  {"dump",     (PyCFunction)cdbo_dump,     METH_VARARGS|METH_KEYWORDS,
+               cdbo_dump_doc },
+  {"stats",    (PyCFunction)cdbo_stats,    METH_VARARGS,
+               cdbo_stats_doc },
+  {"resetstats", (PyCFunction)cdbo_resetstats, METH_VARARGS,
+               cdbo_resetstats_doc },
+  { NULL,    NULL }
+};
+
+/* ------------------- cdb operations -------------------- */
+
+static PyObject *
+_wrap_cdb_init(int fd, int how, int *err) {  /* constructor implementation */
+
+  CdbObject *self;
+
+  self = PyObject_NEW(CdbObject, &CdbType);
+  if (self == NULL) return NULL;
+
+  memset(&self->c, 0, sizeof self->c); /* cdb struct init'd to zero */
+  *err = cdb_initmap(&self->c, fd, how);
+
+  self->iter_pos   = cdb_hdrsize(&self->c);
+  self->each_pos   = cdb_hdrsize(&self->c);
+  self->numrecords = 0;
+  self->eod        = 0;
+  self->getkey     = NULL;
+  self->zerocopy   = 0;
+  self->have_repeats = 0;
+  self->repeats    = NULL;
+  self->nrepeats   = 0;
+  self->scans      = 0;
+  self->stats      = NULL;
+
+  return (PyObject *) self;
+}
+
+
+static PyObject *
+cdbo_constructor(PyObject *ignore, PyObject *args, PyObject *kwds) {
+
+  static char *kwlist[] = {"f", "zerocopy", "mmap", "populate", "advice",
+                           "hugepages", "mlock", "stats", NULL};
+  PyObject *self;
+  PyObject *f;
+  PyObject *name_attr = Py_None;
+  int fd;
+  int zerocopy = 0;
+  int map = 1, populate = 0, hugepages = 0, lock = 0, stats = 0;
+  char *advice = NULL;
+  int how = 0;
+  int err;
+
+  if (! PyArg_ParseTupleAndKeywords(args, kwds, "O|iiiziii:new", kwlist,
+                                    &f, &zerocopy, &map, &populate, &advice,
+                                    &hugepages, &lock, &stats))
+    return NULL;
+
+  if (!map)       how |= CDB_MAP_NONE;
+  if (populate)   how |= CDB_MAP_POPULATE;
+  if (hugepages)  how |= CDB_MAP_HUGEPAGE;
+  if (lock)       how |= CDB_MAP_LOCK;
+
+  if (advice == NULL || strcmp(advice, "normal") == 0)
+    ;
+  else if (strcmp(advice, "random") == 0)
+    how |= CDB_MAP_RANDOM;
+  else if (strcmp(advice, "willneed") == 0)
+    how |= CDB_MAP_WILLNEED;
+  else {
+    PyErr_SetString(PyExc_ValueError,
+                    "advice must be 'normal', 'random' or 'willneed'");
+    return NULL;
+  }
+
+  if (PyString_Check(f)) {
+
+    if ((fd = open_read(PyString_AsString(f))) == -1)
+      return CDBerr;
+
+    name_attr = f;
+
+  } else if (PyInt_Check(f)) {
+
+    fd = (int) PyInt_AsLong(f);
+
+  } else {
+
+    PyErr_SetString(PyExc_TypeError,
+                    "expected filename or file descriptor");
+    return NULL;
+
+  }
+
+  self = _wrap_cdb_init(fd, how, &err);
+  if (self == NULL) {
+    if (name_attr != Py_None)
+      close(fd);
+    return NULL;
+  }
+
+  ((CdbObject *)self)->name_py = name_attr;
+  Py_INCREF(name_attr);
+
+  if (err == -1) {  /* mlock() failed; dealloc closes what we opened */
+    CDBerr;
+    Py_DECREF(self);
+    return NULL;
+  }
+
+  ((CdbObject *)self)->zerocopy = zerocopy ? 1 : 0;
+
+  if (stats) {
+    ((CdbObject *)self)->stats = PyMem_New(struct cdbo_stats, 1);
+    if (((CdbObject *)self)->stats == NULL) {
+      Py_DECREF(self);
+      return PyErr_NoMemory();
+    }
+    memset(((CdbObject *)self)->stats, 0, sizeof (struct cdbo_stats));
+  }
+
+  return self;
+}
+
+static void
+cdbo_dealloc(CdbObject *self) {  /* del(cdb_o) */
+
+  if (self->name_py != NULL) {
+
+    /* if cdb_o.name is not None:  we open()d it ourselves, so close it */
+    if (PyString_Check(self->name_py))
+      close(self->c.fd);
+
+    Py_DECREF(self->name_py);
+  }
+
+  Py_XDECREF(self->getkey);
+
+  free(self->repeats);
+  PyMem_Free(self->stats);
+
+  cdb_free(&self->c);
+
+  PyObject_DEL(self);
+}
+
+static PyObject *
+cdbo_getattr(CdbObject *self, char *name) {
+
+  PyObject * r;
+
+  r = Py_FindMethod(cdb_methods, (PyObject *) self, name);
+
+  if (r != NULL)
+    return r;
+
+  PyErr_Clear();
+
+  if (!strcmp(name,"__members__"))
+    return Py_BuildValue("[sss]", "fd", "name", "size");
+
+  if (!strcmp(name,"fd")) {
+    return Py_BuildValue("i", self->c.fd);  /* cdb_o.fd */
   } 
 
-  if (!strcmp(name,"name")) {
-    Py_INCREF(self->name_py);
-    return self->name_py;                   /* cdb_o.name */
-  } 
+  if (!strcmp(name,"name")) {
+    Py_INCREF(self->name_py);
+    return self->name_py;                   /* cdb_o.name */
+  } 
+
+  if (!strcmp(name,"size")) {               /* cdb_o.size */
+    return self->c.map ?  /** mmap()d ? stat.st_size : None **/
+           Py_BuildValue("l", (long) self->c.size) :
+           Py_BuildValue("");
+  } 
+
+  PyErr_SetString(PyExc_AttributeError, name);
+  return NULL;
+}
+
+
+/* ----------------- cdb stack object ------------------ */
+
+static char cdbstack_object_doc[] =
+"cdb stack objects, created by stack(), read a list of cdbs, newest\n\
+first, as one:\n\
+\n\
+  Methods:\n\
+    get(k [, i]), getall(k), has_key(k), keys(), iterkeys(),\n\
+    itervalues(), iteritems(), cdb_s[k], iter(cdb_s)\n\
+\n\
+  __members__:\n\
+    layers - the cdb objects, newest first\n\
+\n\
+The newest layer with a record under a key, or a tombstone for it\n\
+(see cdbmake's delete()), decides the key: its records are the\n\
+key's records, or the key is missing.  Iteration yields each key\n\
+the stack finds once, with the data get() returns, newest layer\n\
+first.\n";
+
+static char cdbshards_object_doc[] =
+"cdb shards objects, created by sharded(), read a set of CDBs built\n\
+by cdbmake_sharded() as one.  They have the methods of cdb stack\n\
+objects, and len(); a key is looked up only in the shard its hash\n\
+picks, and iteration goes through the shards in turn.\n\
+\n\
+  __members__:\n\
+    shards - the cdb objects, in manifest order\n";
+
+staticforward PyTypeObject CdbStackType;
+staticforward PyTypeObject CdbShardsType;
+
+#define _cdbs_layer(self, i) ((CdbObject *) PyTuple_GET_ITEM((self)->layers, (i)))
+
+/* _cdbs_locate(), without the GIL */
+static int
+_cdbs_find(CdbStackObject *self, struct cdb_cursor *k, char *key,
+           unsigned int klen, unsigned int *layer) {
+
+  int r;
+
+  Py_BEGIN_ALLOW_THREADS
+  r = _cdbs_locate(self, layer, k, key, klen);
+  Py_END_ALLOW_THREADS
+
+  return r;
+}
+
+static PyObject *
+cdbs_has_key(CdbStackObject *self, PyObject *args) {
+
+  struct cdb_cursor k;
+  char * key;
+  unsigned int klen, layer;
+  int r;
+
+  if (!PyArg_ParseTuple(args, "s#:has_key", &key, &klen))
+    return NULL;
+
+  r = _cdbs_find(self, &k, key, klen, &layer);
+  if (r == -1) return CDBerr;
+
+  return Py_BuildValue("i", r);
+}
+
+static PyObject *
+cdbs_get(CdbStackObject *self, PyObject *args) {
+
+  struct cdb_cursor k;
+  char * key;
+  unsigned int klen, layer;
+  int r;
+  int i = 0;
+
+  if (!PyArg_ParseTuple(args, "s#|i:get", &key, &klen, &i))
+    return NULL;
+
+  Py_BEGIN_ALLOW_THREADS
+  r = _cdbs_locate(self, &layer, &k, key, klen);
+  for (; (r == 1) && (i > 0); --i)
+    r = cdb_findnext(self->c[layer], &k, key, klen);
+  Py_END_ALLOW_THREADS
+
+  if (r == -1) return CDBerr;
+  if (!r) return Py_BuildValue("");
+
+  return CDBO_CURDATA(_cdbs_layer(self, layer), &k);
+}
+
+static PyObject *
+cdbs_getall(CdbStackObject *self, PyObject *args) {
+
+  PyObject * list, * data;
+  struct cdb_cursor k;
+  char * key;
+  unsigned int klen, layer;
+  int r, err;
+
+  if (!PyArg_ParseTuple(args, "s#:getall", &key, &klen))
+    return NULL;
+
+  list = PyList_New(0);
+
+  if (list == NULL) return NULL;
+
+  for (r = _cdbs_find(self, &k, key, klen, &layer); r == 1;
+       r = cdb_findnext(self->c[layer], &k, key, klen)) {
+    data = CDBO_CURDATA(_cdbs_layer(self, layer), &k);
+    if (data == NULL) {
+      Py_DECREF(list);
+      return NULL;
+    }
+    err = PyList_Append(list, data);
+    Py_DECREF(data);
+    if (err != 0) {
+      Py_DECREF(list);
+      return NULL;
+    }
+  }
+  if (r == -1) {
+    Py_DECREF(list);
+    return CDBerr;
+  }
+
+  return list;
+}
+
+static PyObject *
+cdbs_subscript(CdbStackObject *self, PyObject *k) {
+
+  struct cdb_cursor cur;
+  char * key;
+  int klen;
+  unsigned int layer;
+
+  if (! PyArg_Parse(k, "s#", &key, &klen))
+    return NULL;
+
+  switch(_cdbs_find(self, &cur, key, (unsigned int) klen, &layer)) {
+    case -1:
+      return CDBerr;
+    case 0:
+      PyErr_SetObject(PyExc_KeyError, k);
+      return NULL;
+    default:
+      return CDBO_CURDATA(_cdbs_layer(self, layer), &cur);
+  }
+  /* not reached */
+}
+
+static PyObject *
+_cdbs_iter(CdbStackObject *self, int kind) {
+
+  CdbIterObject *it;
+
+  it = PyObject_NEW(CdbIterObject, &CdbIterType);
+  if (it == NULL)
+    return NULL;
+
+  Py_INCREF(self);
+  it->owner = NULL;
+  it->kind = kind;
+  it->buf = NULL;
+  it->sequential = 0;
+  it->stack = self;
+  it->filter = ! self->sharded;
+  it->layer = 0;
+
+  if (_cdbi_start(it, _cdbs_layer(self, 0)) == -1) {
+    Py_DECREF(it);
+    return NULL;
+  }
+
+  return (PyObject *) it;
+}
+
+static PyObject *
+cdbs_iter(CdbStackObject *self) {
+  return _cdbs_iter(self, CDBI_KEYS);
+}
+
+static PyObject *
+cdbs_iterkeys(CdbStackObject *self, PyObject *args) {
+
+  if (! PyArg_ParseTuple(args, ":iterkeys"))
+    return NULL;
+
+  return _cdbs_iter(self, CDBI_KEYS);
+}
+
+static PyObject *
+cdbs_itervalues(CdbStackObject *self, PyObject *args) {
+
+  if (! PyArg_ParseTuple(args, ":itervalues"))
+    return NULL;
+
+  return _cdbs_iter(self, CDBI_VALUES);
+}
+
+static PyObject *
+cdbs_iteritems(CdbStackObject *self, PyObject *args) {
+
+  if (! PyArg_ParseTuple(args, ":iteritems"))
+    return NULL;
+
+  return _cdbs_iter(self, CDBI_ITEMS);
+}
+
+static PyObject *
+cdbs_keys(CdbStackObject *self, PyObject *args) {
+
+  PyObject *it, *r;
+
+  if (! PyArg_ParseTuple(args, ":keys"))
+    return NULL;
+
+  if ((it = _cdbs_iter(self, CDBI_KEYS)) == NULL)
+    return NULL;
+  r = PySequence_List(it);
+  Py_DECREF(it);
+  return r;
+}
+
+static Py_ssize_t
+cdbs_length(CdbStackObject *self) {
+
+  Py_ssize_t n = 0, r;
+  unsigned int i;
+
+  for (i = 0; i < self->n; i++) {
+    if ((r = cdbo_length(_cdbs_layer(self, i))) == -1)
+      return -1;
+    n += r;
+  }
+  return n;
+}
+
+/* k in cdb_s: a lookup, as has_key() */
+static int
+cdbs_contains(CdbStackObject *self, PyObject *k) {
+
+  struct cdb_cursor cur;
+  char * key;
+  int klen;
+  unsigned int layer;
+  int r;
+
+  if (! PyArg_Parse(k, "s#", &key, &klen))
+    return -1;
+
+  r = _cdbs_find(self, &cur, key, (unsigned int) klen, &layer);
+  if (r == -1)
+    CDBerr;
+  return r;
+}
+
+static PySequenceMethods cdbs_as_sequence = {
+	(lenfunc)0,                   /* sq_length */
+	(binaryfunc)0,                /* sq_concat */
+	(ssizeargfunc)0,              /* sq_repeat */
+	(ssizeargfunc)0,              /* sq_item */
+	(ssizessizeargfunc)0,         /* sq_slice */
+	(ssizeobjargproc)0,           /* sq_ass_item */
+	(ssizessizeobjargproc)0,      /* sq_ass_slice */
+	(objobjproc)cdbs_contains,    /* sq_contains */
+};
+
+static PyMappingMethods cdbshards_as_mapping = {
+	(lenfunc)cdbs_length,
+	(binaryfunc)cdbs_subscript,
+	(objobjargproc)0
+};
+
+static PyMappingMethods cdbs_as_mapping = {
+	(lenfunc)0,
+	(binaryfunc)cdbs_subscript,
+	(objobjargproc)0
+};
+
+static PyMethodDef cdbs_methods[] = {
+
+  {"get",      (PyCFunction)cdbs_get,      METH_VARARGS,
+"cdb_s.get(k [, i]) -> data\n\
+\n\
+As cdb_o.get(), over the layer that decides k." },
+  {"getall",   (PyCFunction)cdbs_getall,   METH_VARARGS,
+"cdb_s.getall(k) -> ['data', ... ]\n\
+\n\
+All records under k in the layer that decides it." },
+  {"has_key",  (PyCFunction)cdbs_has_key,  METH_VARARGS,
+"cdb_s.has_key(k) -> 1 (or 0)\n\
+\n\
+Returns true if some layer has k and no newer one deletes it." },
+  {"keys",     (PyCFunction)cdbs_keys,     METH_VARARGS,
+"cdb_s.keys() -> list\n\
+\n\
+The keys the stack finds, each once." },
+  {"iterkeys", (PyCFunction)cdbs_iterkeys, METH_VARARGS,
+"cdb_s.iterkeys() -> iterator\n\
+\n\
+Iterate over the keys the stack finds, each once.  iter(cdb_s) is\n\
+the same." },
+  {"itervalues", (PyCFunction)cdbs_itervalues, METH_VARARGS,
+"cdb_s.itervalues() -> iterator\n\
+\n\
+Iterate over the data get() returns for each key." },
+  {"iteritems", (PyCFunction)cdbs_iteritems, METH_VARARGS,
+"cdb_s.iteritems() -> iterator\n\
+\n\
+Iterate over (key, data) for each key the stack finds, with the\n\
+data get() returns." },
+  { NULL,    NULL }
+};
+
+/*
+ * A stack or sharded set of type over the sequence seq: cdb objects
+ * are used as they are; anything else is opened by init(), given kwds.
+ */
+static PyObject *
+_cdbs_new(PyTypeObject *type, PyObject *seq, PyObject *kwds) {
+
+  CdbStackObject *self;
+  PyObject *fast, *o, *a;
+  Py_ssize_t n, i;
+
+  fast = PySequence_Fast(seq, "a sequence of cdbs is needed");
+  if (fast == NULL)
+    return NULL;
+
+  n = PySequence_Fast_GET_SIZE(fast);
+  if ((n == 0) || (n != (unsigned int) n)) {
+    Py_DECREF(fast);
+    PyErr_SetString(PyExc_ValueError, "at least one cdb is needed");
+    return NULL;
+  }
+
+  self = PyObject_NEW(CdbStackObject, type);
+  if (self == NULL) {
+    Py_DECREF(fast);
+    return NULL;
+  }
+  self->n = (unsigned int) n;
+  self->sharded = (type != &CdbStackType);
+  self->c = PyMem_New(struct cdb *, n);
+  self->layers = PyTuple_New(n);
+  if ((self->c == NULL) || (self->layers == NULL)) {
+    Py_DECREF(fast);
+    Py_DECREF(self);
+    return PyErr_NoMemory();
+  }
+
+  for (i = 0; i < n; i++) {
+    o = PySequence_Fast_GET_ITEM(fast, i);
+    if (PyObject_TypeCheck(o, &CdbType))
+      Py_INCREF(o);
+    else {
+      if ((a = PyTuple_Pack(1, o)) == NULL)
+        o = NULL;
+      else {
+        o = cdbo_constructor(NULL, a, kwds);
+        Py_DECREF(a);
+      }
+      if (o == NULL) {
+        Py_DECREF(fast);
+        Py_DECREF(self);
+        return NULL;
+      }
+    }
+    PyTuple_SET_ITEM(self->layers, i, o);
+    self->c[i] = &((CdbObject *) o)->c;
+  }
+
+  Py_DECREF(fast);
+  return (PyObject *) self;
+}
+
+static PyObject *
+cdbs_constructor(PyObject *ignore, PyObject *args) {
+
+  PyObject *seq;
+
+  if (! PyArg_ParseTuple(args, "O:stack", &seq))
+    return NULL;
+
+  return _cdbs_new(&CdbStackType, seq, NULL);
+}
+
+/*
+ * The paths of the shard files a set's manifest lists, or NULL with
+ * an exception set.  The manifest is the line "cdb-shards n", then the
+ * n file names, relative to dir, one per line.
+ */
+static PyObject *
+_cdb_manifest(const char *dir) {
+
+  PyObject *list = NULL, *path, *path2;
+  FILE *f;
+  char line[4096];
+  unsigned long n, i;
+  size_t len;
+
+  path = PyString_FromFormat("%s/manifest", dir);
+  if (path == NULL)
+    return NULL;
+  f = fopen(PyString_AS_STRING(path), "r");
+  if (f == NULL) {
+    PyErr_SetFromErrnoWithFilename(PyExc_IOError, PyString_AS_STRING(path));
+    Py_DECREF(path);
+    return NULL;
+  }
+
+  if ((fgets(line, sizeof line, f) == NULL) ||
+      (sscanf(line, "cdb-shards %lu", &n) != 1) || (n == 0))
+    goto FORMAT;
+  if ((list = PyList_New(0)) == NULL)
+    goto FAIL;
+  for (i = 0; i < n; i++) {
+    if (fgets(line, sizeof line, f) == NULL)
+      goto FORMAT;
+    len = strlen(line);
+    if ((len < 2) || (line[len - 1] != '\n') || strchr(line, '/'))
+      goto FORMAT;
+    line[len - 1] = 0;
+    if (((path2 = PyString_FromFormat("%s/%s", dir, line)) == NULL) ||
+        (PyList_Append(list, path2) == -1)) {
+      Py_XDECREF(path2);
+      goto FAIL;
+    }
+    Py_DECREF(path2);
+  }
+  if (fgets(line, sizeof line, f) != NULL)
+    goto FORMAT;
+
+  fclose(f);
+  Py_DECREF(path);
+  return list;
+
+  FORMAT:
+  PyErr_Format(CDBError, "bad shard manifest %s", PyString_AS_STRING(path));
+  FAIL:
+  fclose(f);
+  Py_DECREF(path);
+  Py_XDECREF(list);
+  return NULL;
+}
+
+static PyObject *
+cdbs_sharded(PyObject *ignore, PyObject *args, PyObject *kwds) {
+
+  CdbStackObject *self;
+  PyObject *paths;
+  char *dir;
+  unsigned int i;
+
+  if (! PyArg_ParseTuple(args, "s:sharded", &dir))
+    return NULL;
+
+  if ((paths = _cdb_manifest(dir)) == NULL)
+    return NULL;
+  self = (CdbStackObject *) _cdbs_new(&CdbShardsType, paths, kwds);
+  Py_DECREF(paths);
+  if (self == NULL)
+    return NULL;
+
+  /* routing hashes a key once, with the function every shard uses */
+  for (i = 1; i < self->n; i++)
+    if ((self->c[i]->flags ^ self->c[0]->flags) & CDB_F_WORDHASH) {
+      Py_DECREF(self);
+      PyErr_Format(CDBError, "shards of %s use different hash functions", dir);
+      return NULL;
+    }
+
+  return (PyObject *) self;
+}
+
+static void
+cdbs_dealloc(CdbStackObject *self) {
+
+  Py_XDECREF(self->layers);
+  PyMem_Free(self->c);
+  PyObject_DEL(self);
+}
+
+static PyObject *
+cdbs_getattr(CdbStackObject *self, char *name) {
+
+  PyObject * r;
+
+  r = Py_FindMethod(cdbs_methods, (PyObject *) self, name);
+
+  if (r != NULL)
+    return r;
+
+  PyErr_Clear();
+
+  if (!strcmp(name,"__members__"))
+    return Py_BuildValue("[s]", self->sharded ? "shards" : "layers");
+
+  if (!strcmp(name, self->sharded ? "shards" : "layers")) {
+    Py_INCREF(self->layers);
+    return self->layers;                    /* cdb_s.layers */
+  }
+
+  PyErr_SetString(PyExc_AttributeError, name);
+  return NULL;
+}
+
+
+/* ----------------- cdbmake object ------------------ */
+
+static char cdbmake_object_doc[] =
+"cdbmake objects resemble the struct cdb_make interface:\n\
+\n\
+  CDB Construction Methods:\n\
+    add(k, v), addmany(pairs), addfile(f), merge(cdb_o), delete(k),\n\
+    finish()\n\
+\n\
+  __members__:\n\
+    fd         - fd of underlying CDB, or -1 if finish()ed\n\
+    fn, fntmp  - as from the cdb package's cdbmake utility\n\
+    numentries - current number of records add()ed\n\
+    load       - records per hash slot: as asked for, and once\n\
+                 finish()ed, as achieved\n\
+    hitprobes  - after finish(), mean slots read to find a record\n\
+    missprobes - after finish(), mean slots read by a miss\n";
+
+typedef struct {
+    PyObject_HEAD
+    struct cdb_make cm;
+    PyObject * fn;
+    PyObject * fntmp;
+    char finished;
+    char busy; /* another thread is adding without the GIL */
+} cdbmakeobject;
+
+staticforward PyTypeObject CdbMakeType;
+
+#define CDBMAKEerr PyErr_SetFromErrno(PyExc_IOError)
+#define CDBMAKEfinished PyErr_SetString(CDBError, "cdbmake object already finished")
+
+#define ADDMANY 1024 /* records added per release of the GIL */
+
+/* 0 if cm may be written now; otherwise -1 with the exception set */
+static int
+_cdbmake_ready(cdbmakeobject *self) {
+  if (self->finished) {
+    CDBMAKEfinished;
+    return -1;
+  }
+  if (self->busy) {
+    PyErr_SetString(CDBError, "cdbmake object in use by another thread");
+    return -1;
+  }
+  return 0;
+}
+
+
+/* ----------------- CdbMake methods ------------------ */
+
+static PyObject *
+CdbMake_add(cdbmakeobject *self, PyObject *args) {
+
+  char * key, * dat;
+  unsigned int klen, dlen;
+
+  if (!PyArg_ParseTuple(args,"s#s#:add",&key,&klen,&dat,&dlen))
+    return NULL;
+
+  if (_cdbmake_ready(self) == -1)
+    return NULL;
+
+  if (cdb_make_add(&self->cm, key, klen, dat, dlen) == -1)
+    return CDBMAKEerr;
+
+  return Py_BuildValue("");
+
+}
 
-  if (!strcmp(name,"size")) {               /* cdb_o.size */
-    return self->c.map ?  /** mmap()d ? stat.st_size : None **/
-           Py_BuildValue("l", (long) self->c.size) :
-           Py_BuildValue("");
-  } 
+/*
+ * Add the pairs of seq to the n files of cm, routed by cdb_shard()
+ * when there is more than one, in batches of ADDMANY: gather a
+ * batch, holding the strings, then add it without the GIL.  Pairs
+ * ahead of a bad one are still added.
+ */
+static PyObject *
+_cdbmake_addmany(PyObject *seq, struct cdb_make **cm, unsigned int ncm,
+                 char *busy) {
 
-  PyErr_SetString(PyExc_AttributeError, name);
-  return NULL;
+  PyObject *it, *item;
+  PyObject *held[ADDMANY];
+  struct {
+    char *key, *dat;
+    Py_ssize_t klen, dlen;
+  } rec[ADDMANY];
+  int n, m, i, r = 0, err = 0;
+
+  if ((it = PyObject_GetIter(seq)) == NULL)
+    return NULL;
+
+  do {
+    for (n = m = 0; n < ADDMANY && (item = PyIter_Next(it)) != NULL; ++n) {
+      held[n] = item;
+      if (!PyTuple_Check(item) || PyTuple_GET_SIZE(item) != 2) {
+        PyErr_SetString(PyExc_TypeError,
+                        "iterable of (key, data) tuples expected");
+        ++n;
+        break;
+      }
+      if ((PyString_AsStringAndSize(PyTuple_GET_ITEM(item, 0),
+                                    &rec[n].key, &rec[n].klen) < 0) ||
+          (PyString_AsStringAndSize(PyTuple_GET_ITEM(item, 1),
+                                    &rec[n].dat, &rec[n].dlen) < 0)) {
+        ++n;
+        break;
+      }
+      ++m;
+    }
+
+    *busy = 1;
+    Py_BEGIN_ALLOW_THREADS
+    for (i = 0; i < m; i++)
+      if ((r = cdb_make_shardadd(cm, ncm, rec[i].key, rec[i].klen,
+                                 rec[i].dat, rec[i].dlen)) == -1) {
+        err = errno;
+        break;
+      }
+    Py_END_ALLOW_THREADS
+    *busy = 0;
+
+    for (i = 0; i < n; i++)
+      Py_DECREF(held[i]);
+
+    if (r == -1) {
+      Py_DECREF(it);
+      if (PyErr_Occurred())
+        return NULL;
+      errno = err;
+      return CDBMAKEerr;
+    }
+  } while (m == ADDMANY);
+
+  Py_DECREF(it);
+  if (PyErr_Occurred())
+    return NULL;
+
+  return Py_BuildValue("");
 }
 
+static PyObject *
+CdbMake_addmany(cdbmakeobject *self, PyObject *args) {
 
-/* ----------------- cdbmake object ------------------ */
+  PyObject *seq;
+  struct cdb_make *cm = &self->cm;
 
-static char cdbmake_object_doc[] =
-"cdbmake objects resemble the struct cdb_make interface:\n\
+  if (!PyArg_ParseTuple(args,"O:addmany",&seq))
+    return NULL;
+
+  if (_cdbmake_ready(self) == -1)
+    return NULL;
+
+  return _cdbmake_addmany(seq, &cm, 1, &self->busy);
+}
+
+static PyObject *
+CdbMake_addfile(cdbmakeobject *self, PyObject *args) {
+
+  PyObject *f;
+  int fd, opened = 0, r, err;
+  uint64 added;
+
+  if (!PyArg_ParseTuple(args,"O:addfile",&f))
+    return NULL;
+
+  if (_cdbmake_ready(self) == -1)
+    return NULL;
+
+  if (PyString_Check(f)) {
+    if ((fd = open_read(PyString_AsString(f))) == -1)
+      return CDBMAKEerr;
+    opened = 1;
+  } else if (PyInt_Check(f)) {
+    fd = (int) PyInt_AsLong(f);
+  } else {
+    PyErr_SetString(PyExc_TypeError,
+                    "expected filename or file descriptor");
+    return NULL;
+  }
+
+  self->busy = 1;
+  Py_BEGIN_ALLOW_THREADS
+  r = cdb_make_load(&self->cm, fd, &added);
+  err = errno;
+  if (opened) close(fd);
+  Py_END_ALLOW_THREADS
+  self->busy = 0;
+
+  if (r == -1) {
+    errno = err;
+    return CDBMAKEerr;
+  }
+  if (r == -3) {
+    /* part of a record is out; finishing would give a corrupt cdb */
+    self->finished = 1;
+    if (err) {
+      errno = err;
+      return CDBMAKEerr;
+    }
+    PyErr_Format(CDBError, "bad cdbmake input after %llu records; "
+                 "cdbmake object unusable after bad input",
+                 (unsigned PY_LONG_LONG) added);
+    return NULL;
+  }
+  if (r == -2) {
+    PyErr_Format(CDBError, "bad cdbmake input after %llu records",
+                 (unsigned PY_LONG_LONG) added);
+    return NULL;
+  }
+
+  return PyLong_FromUnsignedLongLong(added);
+}
+
+static PyObject *
+CdbMake_delete(cdbmakeobject *self, PyObject *args) {
+
+  char * key;
+  unsigned int klen;
+
+  if (!PyArg_ParseTuple(args,"s#:delete",&key,&klen))
+    return NULL;
+
+  if (_cdbmake_ready(self) == -1)
+    return NULL;
+
+  if (cdb_make_delete(&self->cm, key, klen) == -1)
+    return CDBMAKEerr;
+
+  return Py_BuildValue("");
+
+}
+
+static PyObject *
+CdbMake_merge(cdbmakeobject *self, PyObject *args, PyObject *kwds) {
+
+  static char *kwlist[] = {"cdb", "delete", NULL};
+  CdbObject *old;
+  PyObject *del = NULL, *it, *key;
+  struct cdb_cursor k;
+  uint64 *skip = NULL, *grown;
+  uint64 nskip = 0, room = 0, before;
+  char *kp;
+  Py_ssize_t klen;
+  int r, err;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "O!|O:merge", kwlist,
+                                   &CdbType, &old, &del))
+    return NULL;
+
+  if (_cdbmake_ready(self) == -1)
+    return NULL;
+
+  /* every record under a deleted key is left behind */
+  if (del != NULL) {
+    if ((it = PyObject_GetIter(del)) == NULL)
+      return NULL;
+    while ((key = PyIter_Next(it)) != NULL) {
+      if (PyString_AsStringAndSize(key, &kp, &klen) < 0) {
+        Py_DECREF(key);
+        break;
+      }
+      cdb_findstart(&k);
+      while ((r = cdb_findnext(&old->c, &k, kp, klen)) == 1) {
+        if (nskip == room) {
+          room = room ? 2 * room : 64;
+          grown = skip;  /* on failure, skip is still ours to free */
+          if (PyMem_Resize(grown, uint64, room) == NULL) {
+            PyErr_NoMemory();
+            break;
+          }
+          skip = grown;
+        }
+        skip[nskip++] = cdb_datapos(&k) - klen - 2 * old->c.w;
+      }
+      Py_DECREF(key);
+      if (r == -1)
+        CDBerr;
+      if (PyErr_Occurred())
+        break;
+    }
+    Py_DECREF(it);
+    if (PyErr_Occurred()) {
+      PyMem_Free(skip);
+      return NULL;
+    }
+  }
+
+  before = self->cm.numentries;
+  self->busy = 1;
+  Py_BEGIN_ALLOW_THREADS
+  r = cdb_make_merge(&self->cm, &old->c, skip, nskip);
+  err = errno;
+  Py_END_ALLOW_THREADS
+  self->busy = 0;
+  PyMem_Free(skip);
+
+  if (r == -1) {
+    errno = err;
+    return CDBMAKEerr;
+  }
+
+  return PyLong_FromUnsignedLongLong(self->cm.numentries - before);
+}
+
+static PyObject *
+CdbMake_finish(cdbmakeobject *self, PyObject *args, PyObject *kwds) {
+
+  static char *kwlist[] = {"threads", NULL};
+  int threads = 1;
+  int r;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "|i:finish", kwlist, &threads))
+    return NULL;
+
+  if (_cdbmake_ready(self) == -1)
+    return NULL;
+  self->finished = 1;
+
+  if (threads <= 0)
+    threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+  self->cm.threads = threads;
+
+  Py_BEGIN_ALLOW_THREADS
+  r = cdb_make_finish(&self->cm);
+  Py_END_ALLOW_THREADS
+
+  if (r == -1)
+    return CDBMAKEerr;
+
+  /* cleanup as in cdb dist's cdbmake */
+
+  if (fsync(self->cm.fd) == -1)
+    return CDBMAKEerr;
+
+  r = close(self->cm.fd);
+  self->cm.fd = -1;
+  if (r == -1)
+    return CDBMAKEerr;
+
+  if (rename(PyString_AsString(self->fntmp),
+             PyString_AsString(self->fn))    == -1)
+    return CDBMAKEerr;
+
+  return Py_BuildValue("");
+}
+
+static PyMethodDef cdbmake_methods[] = {
+  {"add",    (PyCFunction)CdbMake_add,    METH_VARARGS,
+"cm.add(key, data) -> None\n\
 \n\
-  CDB Construction Methods:\n\
-    add(k, v), finish()\n\
+Add 'key' -> 'data' pair to the underlying CDB." },
+  {"addmany",    (PyCFunction)CdbMake_addmany,    METH_VARARGS,
+"cm.addmany([(key1,data1),(key2,data2)...]) -> None\n\
 \n\
-  __members__:\n\
-    fd         - fd of underlying CDB, or -1 if finish()ed\n\
-    fn, fntmp  - as from the cdb package's cdbmake utility\n\
-    numentries - current number of records add()ed\n";
+Add many 'key' -> 'data' pairs to the underlying CDB.  Any iterable\n\
+of pairs will do, such as a generator; it is consumed in batches,\n\
+each written without holding the GIL." },
+  {"addfile",    (PyCFunction)CdbMake_addfile,    METH_VARARGS,
+"cm.addfile(f) -> int\n\
+\n\
+Add the records of cdbmake input, +klen,dlen:key->data lines ended\n\
+by a blank line, from f, a filename or file descriptor.  The input\n\
+is parsed in C without the GIL, and nothing is kept per record but\n\
+its hash.  Reading from a descriptor may consume input beyond the\n\
+blank line.  Returns the number of records added; cdb.error is\n\
+raised if the input is malformed or ends early.  If that, or a\n\
+write error, happens partway through a record, the cdbmake object\n\
+cannot be used again." },
+  {"merge",  (PyCFunction)CdbMake_merge,  METH_VARARGS|METH_KEYWORDS,
+"cm.merge(cdb_o [, delete]) -> int\n\
+\n\
+Copy the records of the cdb object cdb_o, except those under the\n\
+keys in the iterable delete, and return how many were copied.  To\n\
+replace a key, delete it here and add() its new records.  The\n\
+records go across in large runs without the GIL, within the kernel\n\
+where possible, and keep the hashes stored in cdb_o's tables rather\n\
+than hashing every key again; a cdb of another width or hash\n\
+function is copied record by record.  The result is the same as\n\
+adding the copied records one at a time." },
+  {"delete", (PyCFunction)CdbMake_delete, METH_VARARGS,
+"cm.delete(key) -> None\n\
+\n\
+Record a tombstone for key.  The new CDB's own records are not\n\
+affected, but in a cdb.stack() it hides key in every older layer,\n\
+so a small delta can remove keys from a large base." },
+  {"finish", (PyCFunction)CdbMake_finish, METH_VARARGS|METH_KEYWORDS,
+"cm.finish([threads]) -> None\n\
+\n\
+Finish safely composing a new CDB, renaming cm.fntmp to\n\
+cm.fn.\n\
+\n\
+The 256 hash tables are built by up to 'threads' workers (default:\n\
+1; 0 means one per online CPU), each writing its tables in place." },
+  { NULL,    NULL }
+};
 
-typedef struct {
-    PyObject_HEAD
-    struct cdb_make cm;
-    PyObject * fn;
-    PyObject * fntmp;
-    char finished;
-} cdbmakeobject;
+/* ----------------- cdbmake operations ------------------ */
+
+static PyObject *
+new_cdbmake(PyObject *ignore, PyObject *args, PyObject *kwds) {
+
+  static char *kwlist[] = {"cdb", "tmp", "cdb64", "direct", "wordhash",
+                           "bloom", "robinhood", "load", "spill",
+                           "expected_records", NULL};
+  cdbmakeobject *self;
+  PyObject *fn, *fntmp;
+  int fd;
+  int cdb64 = 0;
+  int direct = 0;
+  int wordhash = 0;
+  int bloom = 0;
+  int robinhood = 0;
+  double load = 0.5;
+  char *spill = NULL;
+  PY_LONG_LONG expect = 0;
+  uint32 flags;
+
+  if (! PyArg_ParseTupleAndKeywords(args, kwds, "SS|iiiiidzL:cdbmake", kwlist,
+                                    &fn, &fntmp, &cdb64, &direct, &wordhash,
+                                    &bloom, &robinhood, &load, &spill,
+                                    &expect))
+    return NULL;
+
+  if (expect < 0) {
+    PyErr_SetString(PyExc_ValueError, "expected_records must not be negative");
+    return NULL;
+  }
+
+  if (!(load >= 1.0 / 65536 && load < 1.0)) {
+    PyErr_SetString(PyExc_ValueError, "load must be above 0 and below 1");
+    return NULL;
+  }
+
+  if ((bloom < 0) || (bloom > 64)) {
+    PyErr_SetString(PyExc_ValueError, "bloom must be 0 to 64 bits per key");
+    return NULL;
+  }
+
+  flags = 0;
+  if (cdb64) flags |= CDB_F_64;
+  if (wordhash) flags |= CDB_F_WORDHASH;
+  if (robinhood) flags |= CDB_F_ROBINHOOD;
+
+  fd = open(PyString_AsString(fntmp), O_RDWR|O_CREAT|O_TRUNC, 0666);
+  if (fd == -1) {
+    return CDBMAKEerr;
+  }
+
+  self = PyObject_NEW(cdbmakeobject, &CdbMakeType);
+  if (self == NULL) {
+    close(fd);
+    return NULL;
+  }
+
+  self->fn = fn;
+  Py_INCREF(self->fn);
+
+  self->fntmp = fntmp;
+  Py_INCREF(fntmp);
+
+  self->finished = 0;
+  self->busy = 0;
+
+  if ((cdb_make_start(&self->cm, fd, flags) == -1) ||
+      (direct && (cdb_make_direct(&self->cm) == -1)) ||
+      (spill && (cdb_make_spill(&self->cm, spill) == -1)) ||
+      (expect && (cdb_make_expect(&self->cm, expect) == -1))) {
+    CDBMAKEerr;
+    Py_DECREF(self);
+    return NULL;
+  }
+  self->cm.bloombits = bloom;
+  self->cm.load = (uint32) (load * 65536 + 0.5);
+  if (self->cm.load > 65535) self->cm.load = 65535; /* leave a slot empty */
+
+  return (PyObject *) self;
+}
+
+static void
+cdbmake_dealloc(cdbmakeobject *self) {
+
+  Py_XDECREF(self->fn);
+
+  if (self->fntmp != NULL) {
+    if (self->cm.fd != -1) {
+      close(self->cm.fd);
+      unlink(PyString_AsString(self->fntmp));
+    }
+    Py_DECREF(self->fntmp);
+  }
+
+  cdb_make_free(&self->cm);
+
+  PyObject_DEL(self);
+}
+
+static PyObject *
+cdbmake_getattr(cdbmakeobject *self, char *name) {
+
+  if (!strcmp(name,"__members__"))
+    return Py_BuildValue("[sssssss]", "fd", "fn", "fntmp", "numentries",
+                         "load", "hitprobes", "missprobes");
+
+  if (!strcmp(name,"fd"))
+    return Py_BuildValue("i", self->cm.fd);  /* self.fd */
+
+  if (!strcmp(name,"fn")) {
+    Py_INCREF(self->fn);
+    return self->fn;                         /* self.fn */
+  }
+
+  if (!strcmp(name,"fntmp")) {
+    Py_INCREF(self->fntmp);
+    return self->fntmp;                      /* self.fntmp */
+  }
+
+  if (!strcmp(name,"numentries"))
+    return Py_BuildValue("l", self->cm.numentries); /* self.numentries */
+
+  if (!strcmp(name,"load")) {
+    if (self->cm.slots)  /* as achieved by finish() */
+      return PyFloat_FromDouble((double) self->cm.numentries / self->cm.slots);
+    return PyFloat_FromDouble(self->cm.load / 65536.0);
+  }
+
+  if (!strcmp(name,"hitprobes") || !strcmp(name,"missprobes")) {
+    if (!self->cm.slots)
+      return Py_BuildValue("");
+    if (name[0] == 'h')
+      return PyFloat_FromDouble((double) self->cm.hitprobes /
+                                self->cm.numentries);
+    return PyFloat_FromDouble((double) self->cm.missprobes / self->cm.slots);
+  }
+
+  return Py_FindMethod(cdbmake_methods, (PyObject *) self, name);
+}
+
+/* ----------------- sharded cdbmake object ------------------ */
+
+static char cdbmakesharded_object_doc[] =
+"cdbmake_sharded objects build a sharded set of CDBs in a directory:\n\
+\n\
+  Methods:\n\
+    add(k, v), addmany(pairs), finish([threads])\n\
+\n\
+  __members__:\n\
+    dir        - the set's directory\n\
+    nshards    - number of shards\n\
+    numentries - current number of records add()ed\n";
 
-staticforward PyTypeObject CdbMakeType;
+typedef struct {
+    PyObject_HEAD
+    PyObject * makers;   /* tuple of cdbmake objects, one per shard */
+    struct cdb_make ** cm; /* their struct cdb_makes */
+    unsigned int n;
+    PyObject * dir;
+    char build[48];      /* names this build's files in dir */
+    char finished;
+    char busy;
+} CdbMakeShardedObject;
 
-#define CDBMAKEerr PyErr_SetFromErrno(PyExc_IOError)
-#define CDBMAKEfinished PyErr_SetString(CDBError, "cdbmake object already finished")
+staticforward PyTypeObject CdbMakeShardedType;
 
+#define _cdbms_maker(self, i) ((cdbmakeobject *) PyTuple_GET_ITEM((self)->makers, (i)))
 
-/* ----------------- CdbMake methods ------------------ */
+static int
+_cdbms_ready(CdbMakeShardedObject *self) {
+  if (self->finished) {
+    CDBMAKEfinished;
+    return -1;
+  }
+  if (self->busy) {
+    PyErr_SetString(CDBError, "cdbmake object in use by another thread");
+    return -1;
+  }
+  return 0;
+}
 
 static PyObject *
-CdbMake_add(cdbmakeobject *self, PyObject *args) {
+CdbMakeSharded_add(CdbMakeShardedObject *self, PyObject *args) {
 
   char * key, * dat;
   unsigned int klen, dlen;
@@ -731,194 +2683,288 @@ CdbMake_add(cdbmakeobject *self, PyObject *args) {
   if (!PyArg_ParseTuple(args,"s#s#:add",&key,&klen,&dat,&dlen))
     return NULL;
 
-  if (self->finished) {
-    CDBMAKEfinished;
+  if (_cdbms_ready(self) == -1)
     return NULL;
-  }
 
-  if (cdb_make_add(&self->cm, key, klen, dat, dlen) == -1)
+  if (cdb_make_shardadd(self->cm, self->n, key, klen, dat, dlen) == -1)
     return CDBMAKEerr;
 
   return Py_BuildValue("");
-
 }
 
 static PyObject *
-CdbMake_addmany(cdbmakeobject *self, PyObject *args) {
+CdbMakeSharded_addmany(CdbMakeShardedObject *self, PyObject *args) {
 
-  PyObject *list;
+  PyObject *seq;
 
-  if (!PyArg_ParseTuple(args,"O!:addmany",&PyList_Type, &list))
+  if (!PyArg_ParseTuple(args,"O:addmany",&seq))
     return NULL;
 
-  if (self->finished) {
-    CDBMAKEfinished;
+  if (_cdbms_ready(self) == -1)
     return NULL;
-  }
-
-  Py_ssize_t size = PyList_Size(list);
-  Py_ssize_t i;
-
-  for (i=0; i<size; i++)
-  {
-    PyObject *tuple = PyList_GetItem(list, i);
-    PyObject *key_item;
-    PyObject *data_item;
-
-    if (!PyTuple_Check(tuple)) {
-      PyErr_SetString(PyExc_TypeError, "list of tuples expected");
-      return NULL;
-    }
-
-    if (!(key_item = PyTuple_GetItem(tuple,0)))
-      return NULL;
-
-    if (!(data_item = PyTuple_GetItem(tuple,1)))
-      return NULL;
 
-    char *key, *dat;
-    Py_ssize_t klen, dlen;
+  return _cdbmake_addmany(seq, self->cm, self->n, &self->busy);
+}
 
-    if (PyString_AsStringAndSize(key_item, &key, &klen) < 0)
-      return NULL;
+/* remove the first n shards, renamed into place but never listed */
+static void
+_cdbms_discard(CdbMakeShardedObject *self, unsigned int n) {
 
-    if (PyString_AsStringAndSize(data_item, &dat, &dlen) < 0)
-      return NULL;
-    
-    if (cdb_make_add(&self->cm, key, klen, dat, dlen) == -1)
-      return CDBMAKEerr;
-  }
+  unsigned int i;
+  int err = errno;
 
-  return Py_BuildValue("");
+  for (i = 0; i < n; i++)
+    unlink(PyString_AsString(_cdbms_maker(self, i)->fn));
+  errno = err;
 }
 
 static PyObject *
-CdbMake_finish(cdbmakeobject *self, PyObject *args) {
+CdbMakeSharded_finish(CdbMakeShardedObject *self, PyObject *args,
+                      PyObject *kwds) {
+
+  static char *kwlist[] = {"threads", NULL};
+  cdbmakeobject *m;
+  PyObject *old, *fn, *fntmp;
+  char *dir = PyString_AS_STRING(self->dir);
+  int threads = 0;
+  unsigned int i;
+  FILE *f;
+  int r;
 
-  if (!PyArg_ParseTuple(args, ":finish"))
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "|i:finish", kwlist, &threads))
     return NULL;
 
-  if (self->finished) {
-    CDBMAKEfinished;
+  if (_cdbms_ready(self) == -1)
     return NULL;
-  }
   self->finished = 1;
 
-  if (cdb_make_finish(&self->cm) == -1)
-    return CDBMAKEerr;
+  if (threads <= 0)
+    threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
 
-  /* cleanup as in cdb dist's cdbmake */
+  Py_BEGIN_ALLOW_THREADS
+  r = cdb_make_shardfinish(self->cm, self->n, threads);
+  Py_END_ALLOW_THREADS
 
-  if (fsync(fileno(self->cm.fp)) == -1)
+  if (r == -1)
     return CDBMAKEerr;
 
-  if (fclose(self->cm.fp) != 0)
-    return CDBMAKEerr;
+  for (i = 0; i < self->n; i++) {
+    m = _cdbms_maker(self, i);
+    m->finished = 1;
+    r = close(m->cm.fd);
+    m->cm.fd = -1;
+    if ((r == -1) ||
+        (rename(PyString_AsString(m->fntmp), PyString_AsString(m->fn)) == -1)) {
+      r = errno;
+      unlink(PyString_AsString(m->fntmp));
+      errno = r;
+      _cdbms_discard(self, i);
+      return CDBMAKEerr;
+    }
+  }
 
-  self->cm.fp = NULL;
+  /* the new manifest switches readers over to the new shards at once;
+     the old shards go once it is in place */
+  old = _cdb_manifest(dir);
+  if (old == NULL)
+    PyErr_Clear();
+
+  fntmp = PyString_FromFormat("%s/%s.manifest.tmp", dir, self->build);
+  fn = PyString_FromFormat("%s/manifest", dir);
+  if ((fn == NULL) || (fntmp == NULL))
+    goto FAIL;
+  if ((f = fopen(PyString_AS_STRING(fntmp), "w")) == NULL)
+    goto IOFAIL;
+  fprintf(f, "cdb-shards %u\n", self->n);
+  for (i = 0; i < self->n; i++)
+    fprintf(f, "%s\n", strrchr(PyString_AS_STRING(_cdbms_maker(self, i)->fn),
+                               '/') + 1);
+  if ((fflush(f) == EOF) || (fsync(fileno(f)) == -1)) {
+    fclose(f);
+    goto IOFAIL;
+  }
+  if ((fclose(f) == EOF) ||
+      (rename(PyString_AS_STRING(fntmp), PyString_AS_STRING(fn)) == -1))
+    goto IOFAIL;
 
-  if (rename(PyString_AsString(self->fntmp),
-             PyString_AsString(self->fn))    == -1)
-    return CDBMAKEerr;
+  if (old != NULL)
+    for (i = 0; i < PyList_GET_SIZE(old); i++)
+      unlink(PyString_AS_STRING(PyList_GET_ITEM(old, i)));
 
+  Py_XDECREF(old);
+  Py_DECREF(fn);
+  Py_DECREF(fntmp);
   return Py_BuildValue("");
+
+  IOFAIL:
+  CDBMAKEerr;
+  FAIL:
+  if (fntmp != NULL)
+    unlink(PyString_AS_STRING(fntmp));
+  _cdbms_discard(self, self->n);
+  Py_XDECREF(old);
+  Py_XDECREF(fn);
+  Py_XDECREF(fntmp);
+  return NULL;
 }
 
-static PyMethodDef cdbmake_methods[] = {
-  {"add",    (PyCFunction)CdbMake_add,    METH_VARARGS,
-"cm.add(key, data) -> None\n\
+static PyMethodDef cdbmakesharded_methods[] = {
+  {"add",    (PyCFunction)CdbMakeSharded_add,    METH_VARARGS,
+"cms.add(key, data) -> None\n\
 \n\
-Add 'key' -> 'data' pair to the underlying CDB." },
-  {"addmany",    (PyCFunction)CdbMake_addmany,    METH_VARARGS,
-"cm.addmany([(key1,data1),(key2,data2)...]) -> None\n\
+Add 'key' -> 'data' pair to the shard the key's hash picks." },
+  {"addmany",    (PyCFunction)CdbMakeSharded_addmany,    METH_VARARGS,
+"cms.addmany([(key1,data1),(key2,data2)...]) -> None\n\
 \n\
-Add many 'key' -> 'data' pairs to the underlying CDB." },
-  {"finish", (PyCFunction)CdbMake_finish, METH_VARARGS,
-"cm.finish() -> None\n\
+Add many pairs, as cdbmake's addmany() does, each to the shard its\n\
+key's hash picks." },
+  {"finish", (PyCFunction)CdbMakeSharded_finish, METH_VARARGS|METH_KEYWORDS,
+"cms.finish([threads]) -> None\n\
 \n\
-Finish safely composing a new CDB, renaming cm.fntmp to\n\
-cm.fn." },
-  { NULL,    NULL }
+Finish every shard, up to threads at once (all CPUs if 0, the\n\
+default), then write the manifest that makes them the set's\n\
+contents and remove the shards it replaces." },
+  {NULL, NULL}
 };
 
-/* ----------------- cdbmake operations ------------------ */
-
 static PyObject *
-new_cdbmake(PyObject *ignore, PyObject *args) {
+new_cdbmake_sharded(PyObject *ignore, PyObject *args, PyObject *kwds) {
 
-  cdbmakeobject *self;
-  PyObject *fn, *fntmp;
-  FILE * f;
+  CdbMakeShardedObject *self;
+  PyObject *dir, *kw = NULL, *a, *m, *v;
+  PY_LONG_LONG expect;
+  struct timeval tv;
+  struct rlimit rl;
+  char name[64];
+  int n, i;
 
-  if (! PyArg_ParseTuple(args, "SS|i", &fn, &fntmp))
+  if (! PyArg_ParseTuple(args, "Si:cdbmake_sharded", &dir, &n))
     return NULL;
 
-  f = fopen(PyString_AsString(fntmp), "w+b");
-  if (f == NULL) {
-    return CDBMAKEerr;
+  if (n < 1) {
+    PyErr_SetString(PyExc_ValueError, "nshards must be at least 1");
+    return NULL;
   }
 
-  self = PyObject_NEW(cdbmakeobject, &CdbMakeType);
-  if (self == NULL) return NULL;
-
-  self->fn = fn;
-  Py_INCREF(self->fn);
+  /* each shard expects its share of the records */
+  if (kwds != NULL) {
+    if ((kw = PyDict_Copy(kwds)) == NULL)
+      return NULL;
+    v = PyDict_GetItemString(kw, "expected_records");
+    if (v != NULL) {
+      expect = PyLong_AsLongLong(v);
+      if ((expect == -1) && PyErr_Occurred()) {
+        Py_DECREF(kw);
+        return NULL;
+      }
+      if (expect > 0) {
+        v = PyLong_FromLongLong(expect / n + 1);
+        if ((v == NULL) ||
+            (PyDict_SetItemString(kw, "expected_records", v) == -1)) {
+          Py_XDECREF(v);
+          Py_DECREF(kw);
+          return NULL;
+        }
+        Py_DECREF(v);
+      }
+    }
 
-  self->fntmp = fntmp;
-  Py_INCREF(fntmp);
+    /* every spilling shard holds 256 partition files and its output
+       open at once; say so now rather than partway through */
+    v = PyDict_GetItemString(kw, "spill");
+    if ((v != NULL) && (v != Py_None) &&
+        (getrlimit(RLIMIT_NOFILE, &rl) == 0) &&
+        (rl.rlim_cur != RLIM_INFINITY) &&
+        ((unsigned long long) n * 257 > rl.rlim_cur)) {
+      PyErr_Format(CDBError, "spill with %d shards needs %llu open files, "
+                   "over the limit of %llu", n,
+                   (unsigned long long) n * 257,
+                   (unsigned long long) rl.rlim_cur);
+      Py_DECREF(kw);
+      return NULL;
+    }
+  }
 
+  self = PyObject_NEW(CdbMakeShardedObject, &CdbMakeShardedType);
+  if (self == NULL) {
+    Py_XDECREF(kw);
+    return NULL;
+  }
+  Py_INCREF(dir);
+  self->dir = dir;
+  self->n = n;
   self->finished = 0;
-
-  if (cdb_make_start(&self->cm, f) == -1) {
+  self->busy = 0;
+  self->cm = PyMem_New(struct cdb_make *, n);
+  self->makers = PyTuple_New(n);
+  if ((self->cm == NULL) || (self->makers == NULL)) {
+    Py_XDECREF(kw);
     Py_DECREF(self);
-    CDBMAKEerr;
-    return NULL;
+    return PyErr_NoMemory();
+  }
+
+  /* shards are named for this build, so they never replace files an
+     older manifest names */
+  gettimeofday(&tv, NULL);
+  snprintf(self->build, sizeof self->build, "%lx.%x",
+           (unsigned long) tv.tv_sec * 1000000 + tv.tv_usec,
+           (unsigned int) getpid());
+  for (i = 0; i < n; i++) {
+    snprintf(name, sizeof name, "%s.%04d", self->build, i);
+    a = Py_BuildValue("(NN)",
+          PyString_FromFormat("%s/%s.cdb", PyString_AS_STRING(dir), name),
+          PyString_FromFormat("%s/%s.tmp", PyString_AS_STRING(dir), name));
+    m = a ? new_cdbmake(NULL, a, kw) : NULL;
+    Py_XDECREF(a);
+    if (m == NULL) {
+      Py_XDECREF(kw);
+      Py_DECREF(self);
+      return NULL;
+    }
+    PyTuple_SET_ITEM(self->makers, i, m);
+    self->cm[i] = &((cdbmakeobject *) m)->cm;
   }
 
+  Py_XDECREF(kw);
   return (PyObject *) self;
 }
 
 static void
-cdbmake_dealloc(cdbmakeobject *self) {
-
-  Py_XDECREF(self->fn);
-
-  if (self->fntmp != NULL) {
-    if (self->cm.fp != NULL) {
-      fclose(self->cm.fp);
-      unlink(PyString_AsString(self->fntmp));
-    }
-    Py_DECREF(self->fntmp);
-  }
+cdbmakesharded_dealloc(CdbMakeShardedObject *self) {
 
+  Py_XDECREF(self->makers);  /* unfinished shards are removed */
+  Py_XDECREF(self->dir);
+  PyMem_Free(self->cm);
   PyObject_DEL(self);
 }
 
 static PyObject *
-cdbmake_getattr(cdbmakeobject *self, char *name) {
+cdbmakesharded_getattr(CdbMakeShardedObject *self, char *name) {
 
-  if (!strcmp(name,"__members__"))
-    return Py_BuildValue("[ssss]", "fd", "fn", "fntmp", "numentries");
+  PY_LONG_LONG n = 0;
+  unsigned int i;
 
-  if (!strcmp(name,"fd"))
-    return Py_BuildValue("i", fileno(self->cm.fp));  /* self.fd */
+  if (!strcmp(name,"__members__"))
+    return Py_BuildValue("[sss]", "dir", "nshards", "numentries");
 
-  if (!strcmp(name,"fn")) {
-    Py_INCREF(self->fn);
-    return self->fn;                         /* self.fn */
+  if (!strcmp(name,"dir")) {
+    Py_INCREF(self->dir);
+    return self->dir;                        /* self.dir */
   }
 
-  if (!strcmp(name,"fntmp")) {
-    Py_INCREF(self->fntmp);
-    return self->fntmp;                      /* self.fntmp */
-  }
+  if (!strcmp(name,"nshards"))
+    return Py_BuildValue("i", self->n);      /* self.nshards */
 
-  if (!strcmp(name,"numentries"))
-    return Py_BuildValue("l", self->cm.numentries); /* self.numentries */
+  if (!strcmp(name,"numentries")) {          /* self.numentries */
+    for (i = 0; i < self->n; i++)
+      n += self->cm[i]->numentries;
+    return PyLong_FromLongLong(n);
+  }
 
-  return Py_FindMethod(cdbmake_methods, (PyObject *) self, name);
+  return Py_FindMethod(cdbmakesharded_methods, (PyObject *) self, name);
 }
 
+
 /* ---------------- Type delineation -------------------- */
 
 statichere PyTypeObject CdbType = {
@@ -937,16 +2983,115 @@ statichere PyTypeObject CdbType = {
         0,                      /*tp_compare*/
         0,                      /*tp_repr*/
         0,                      /*tp_as_number*/
-        0,                      /*tp_as_sequence*/
+        &cdbo_as_sequence,      /*tp_as_sequence*/
         &cdbo_as_mapping,       /*tp_as_mapping*/
         0,                      /*tp_hash*/
         0,                      /*tp_call*/
         0,                      /*tp_str*/
         0,                      /*tp_getattro*/
         0,                      /*tp_setattro*/
-        0,                      /*tp_as_buffer*/
-        0,                      /*tp_xxx4*/
+        &cdbo_as_buffer,        /*tp_as_buffer*/
+        Py_TPFLAGS_DEFAULT,     /*tp_flags*/
         cdbo_object_doc,        /*tp_doc*/
+        0,                      /*tp_traverse*/
+        0,                      /*tp_clear*/
+        0,                      /*tp_richcompare*/
+        0,                      /*tp_weaklistoffset*/
+        (getiterfunc)cdbo_iter, /*tp_iter*/
+};
+
+statichere PyTypeObject CdbIterType = {
+        PyObject_HEAD_INIT(NULL)
+        0,                      /*ob_size*/
+        "cdb iterator",         /*tp_name*/
+        sizeof(CdbIterObject),  /*tp_basicsize*/
+        0,                      /*tp_itemsize*/
+        /* methods */
+        (destructor)cdbi_dealloc, /*tp_dealloc*/
+        0,                      /*tp_print*/
+        0,                      /*tp_getattr*/
+        0,                      /*tp_setattr*/
+        0,                      /*tp_compare*/
+        0,                      /*tp_repr*/
+        0,                      /*tp_as_number*/
+        0,                      /*tp_as_sequence*/
+        0,                      /*tp_as_mapping*/
+        0,                      /*tp_hash*/
+        0,                      /*tp_call*/
+        0,                      /*tp_str*/
+        PyObject_GenericGetAttr, /*tp_getattro*/
+        0,                      /*tp_setattro*/
+        0,                      /*tp_as_buffer*/
+        Py_TPFLAGS_DEFAULT,     /*tp_flags*/
+        0,                      /*tp_doc*/
+        0,                      /*tp_traverse*/
+        0,                      /*tp_clear*/
+        0,                      /*tp_richcompare*/
+        0,                      /*tp_weaklistoffset*/
+        PyObject_SelfIter,      /*tp_iter*/
+        (iternextfunc)cdbi_iternext, /*tp_iternext*/
+};
+
+statichere PyTypeObject CdbStackType = {
+        PyObject_HEAD_INIT(NULL)
+        0,                      /*ob_size*/
+        "cdb stack",            /*tp_name*/
+        sizeof(CdbStackObject), /*tp_basicsize*/
+        0,                      /*tp_itemsize*/
+        /* methods */
+        (destructor)cdbs_dealloc, /*tp_dealloc*/
+        0,                      /*tp_print*/
+        (getattrfunc)cdbs_getattr, /*tp_getattr*/
+        0,                      /*tp_setattr*/
+        0,                      /*tp_compare*/
+        0,                      /*tp_repr*/
+        0,                      /*tp_as_number*/
+        &cdbs_as_sequence,      /*tp_as_sequence*/
+        &cdbs_as_mapping,       /*tp_as_mapping*/
+        0,                      /*tp_hash*/
+        0,                      /*tp_call*/
+        0,                      /*tp_str*/
+        0,                      /*tp_getattro*/
+        0,                      /*tp_setattro*/
+        0,                      /*tp_as_buffer*/
+        Py_TPFLAGS_DEFAULT,     /*tp_flags*/
+        cdbstack_object_doc,    /*tp_doc*/
+        0,                      /*tp_traverse*/
+        0,                      /*tp_clear*/
+        0,                      /*tp_richcompare*/
+        0,                      /*tp_weaklistoffset*/
+        (getiterfunc)cdbs_iter, /*tp_iter*/
+};
+
+statichere PyTypeObject CdbShardsType = {
+        PyObject_HEAD_INIT(NULL)
+        0,                      /*ob_size*/
+        "cdb shards",           /*tp_name*/
+        sizeof(CdbStackObject), /*tp_basicsize*/
+        0,                      /*tp_itemsize*/
+        /* methods */
+        (destructor)cdbs_dealloc, /*tp_dealloc*/
+        0,                      /*tp_print*/
+        (getattrfunc)cdbs_getattr, /*tp_getattr*/
+        0,                      /*tp_setattr*/
+        0,                      /*tp_compare*/
+        0,                      /*tp_repr*/
+        0,                      /*tp_as_number*/
+        &cdbs_as_sequence,      /*tp_as_sequence*/
+        &cdbshards_as_mapping,  /*tp_as_mapping*/
+        0,                      /*tp_hash*/
+        0,                      /*tp_call*/
+        0,                      /*tp_str*/
+        0,                      /*tp_getattro*/
+        0,                      /*tp_setattro*/
+        0,                      /*tp_as_buffer*/
+        Py_TPFLAGS_DEFAULT,     /*tp_flags*/
+        cdbshards_object_doc,   /*tp_doc*/
+        0,                      /*tp_traverse*/
+        0,                      /*tp_clear*/
+        0,                      /*tp_richcompare*/
+        0,                      /*tp_weaklistoffset*/
+        (getiterfunc)cdbs_iter, /*tp_iter*/
 };
 
 statichere PyTypeObject CdbMakeType = {
@@ -977,31 +3122,208 @@ statichere PyTypeObject CdbMakeType = {
         cdbmake_object_doc,     /*tp_doc*/
 };
 
+statichere PyTypeObject CdbMakeShardedType = {
+        PyObject_HEAD_INIT(NULL)
+        0,                      /*ob_size*/
+        "cdbmake_sharded",      /*tp_name*/
+        sizeof(CdbMakeShardedObject), /*tp_basicsize*/
+        0,                      /*tp_itemsize*/
+        /* methods */
+        (destructor)cdbmakesharded_dealloc, /*tp_dealloc*/
+        0,                      /*tp_print*/
+        (getattrfunc)cdbmakesharded_getattr, /*tp_getattr*/
+        0,                      /*tp_setattr*/
+        0,                      /*tp_compare*/
+        0,                      /*tp_repr*/
+        0,                      /*tp_as_number*/
+        0,                      /*tp_as_sequence*/
+        0,                      /*tp_as_mapping*/
+        0,                      /*tp_hash*/
+        0,                      /*tp_call*/
+        0,                      /*tp_str*/
+        0,                      /*tp_getattro*/
+        0,                      /*tp_setattro*/
+        0,                      /*tp_as_buffer*/
+        0,                      /*tp_xxx4*/
+        cdbmakesharded_object_doc, /*tp_doc*/
+};
+
 /* ---------------- exported functions ------------------ */
 static PyObject *
 _wrap_cdb_hash(PyObject *ignore, PyObject *args) {
 
   char *s;
   int sz;
+  int wordhash = 0;
+
+  if (! PyArg_ParseTuple(args, "s#|i:hash", &s, &sz, &wordhash))
+    return NULL;
+
+  return Py_BuildValue("l", wordhash ? cdb_hashw(s, (unsigned int) sz)
+                                     : cdb_hash(s, (unsigned int) sz));
+
+}
+
+static PyObject *
+_ulonglist(uint64 *v, uint64 n) {
+
+  PyObject *r, *x;
+  uint64 i;
+
+  r = PyList_New((Py_ssize_t) n);
+  if (r == NULL)
+    return NULL;
+  for (i = 0; i < n; i++) {
+    x = PyLong_FromUnsignedLongLong(v[i]);
+    if (x == NULL) {
+      Py_DECREF(r);
+      return NULL;
+    }
+    PyList_SET_ITEM(r, (Py_ssize_t) i, x);
+  }
+  return r;
+}
 
-  if (! PyArg_ParseTuple(args, "s#:hash", &s, &sz))
+static PyObject *
+_wrap_cdb_analyze(PyObject *ignore, PyObject *args) {
+
+  struct cdb c;
+  struct cdb_stat *st;
+  struct cdb_tablestat *ts;
+  PyObject *f, *tables = NULL, *t, *r = NULL;
+  uint64 dist[4096], *all = dist, nall = 0, slots = 0, repeats = 0, most = 0;
+  int fd, opened = 0, i, err;
+  uint64 d;
+
+  if (! PyArg_ParseTuple(args, "O:analyze", &f))
+    return NULL;
+
+  if (PyString_Check(f)) {
+    if ((fd = open_read(PyString_AsString(f))) == -1)
+      return CDBerr;
+    opened = 1;
+  } else if (PyInt_Check(f)) {
+    fd = (int) PyInt_AsLong(f);
+  } else {
+    PyErr_SetString(PyExc_TypeError,
+                    "expected filename or file descriptor");
     return NULL;
+  }
+
+  st = PyMem_New(struct cdb_stat, 1);
+  if (st == NULL) {
+    if (opened) close(fd);
+    return PyErr_NoMemory();
+  }
 
-  return Py_BuildValue("l", cdb_hash(s, (unsigned int) sz));
+  /* plain reads, front to back: the file may be far larger than memory */
+  memset(&c, 0, sizeof c);
+  Py_BEGIN_ALLOW_THREADS
+  cdb_initmap(&c, fd, CDB_MAP_NONE);
+#ifdef POSIX_FADV_SEQUENTIAL
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+  err = cdb_analyze(&c, st);
+  Py_END_ALLOW_THREADS
+
+  if (err == -1) {
+    CDBerr;
+    goto DONE;
+  }
+
+  /* distances over all tables */
+  for (i = 0; i < 256; i++)
+    if (st->t[i].ndist > nall)
+      nall = st->t[i].ndist;
+  if (nall > sizeof dist / sizeof dist[0]) {
+    all = PyMem_New(uint64, nall);
+    if (all == NULL) {
+      PyErr_NoMemory();
+      goto DONE;
+    }
+  }
+  memset(all, 0, nall * sizeof *all);
+
+  tables = PyList_New(256);
+  if (tables == NULL)
+    goto DONE;
+
+  for (i = 0; i < 256; i++) {
+    ts = st->t + i;
+    for (d = 0; d < ts->ndist; d++)
+      all[d] += ts->dist[d];
+    slots += ts->hslots;
+    repeats += ts->repeats;
+    if (ts->records > most)
+      most = ts->records;
+
+    t = Py_BuildValue("{sKsKsKsdsKsN}",
+                      "position", ts->hpos,
+                      "slots", ts->hslots,
+                      "records", ts->records,
+                      "fill", ts->hslots ? (double) ts->records / ts->hslots
+                                         : 0.0,
+                      "repeats", ts->repeats,
+                      "distances", _ulonglist(ts->dist, ts->ndist));
+    if (t == NULL)
+      goto DONE;
+    PyList_SET_ITEM(tables, i, t);
+  }
 
+  r = Py_BuildValue("{sKsKsKsdsds{sKsKsKsKsKsK}sNsO}",
+                    "size", c.size,
+                    "records", st->records,
+                    "repeats", repeats,
+                    "fill", slots ? (double) st->records / slots : 0.0,
+                    "skew", st->records ? most * 256.0 / st->records : 0.0,
+                    "bytes",
+                      "header", st->hdrbytes,
+                      "lengths", st->recbytes,
+                      "keys", st->keybytes,
+                      "values", st->databytes,
+                      "tables", st->tablebytes,
+                      "trailer", st->trailerbytes,
+                    "distances", _ulonglist(all, nall),
+                    "tables", tables);
+
+  DONE:
+  Py_XDECREF(tables);
+  if (all != dist)
+    PyMem_Free(all);
+  cdb_analyze_free(st);
+  PyMem_Free(st);
+  cdb_free(&c);
+  if (opened) close(fd);
+  return r;
 }
 
 /* ---------------- cdb Module -------------------- */
 
 static PyMethodDef module_functions[] = {
-  {"init",    cdbo_constructor, METH_VARARGS,
-"cdb.init(f) -> cdb_object\n\
+  {"init",    (PyCFunction)cdbo_constructor, METH_VARARGS|METH_KEYWORDS,
+"cdb.init(f [, zerocopy, mmap, populate, advice, hugepages, mlock,\n\
+          stats]) -> cdb_object\n\
 \n\
 Open a CDB specified by f and return a cdb object.\n\
 f may be a filename or an integral file descriptor\n\
-(e.g., init( sys.stdin.fileno() )...)."},
-  {"cdbmake", new_cdbmake,     METH_VARARGS,
-"cdb.cdbmake(cdb, tmp) -> cdbmake_object\n\
+(e.g., init( sys.stdin.fileno() )...).\n\
+\n\
+If zerocopy is true and the file is mmap()d, values are returned\n\
+as read-only buffer objects pointing straight into the map rather\n\
+than as copied strings.  Each buffer keeps the cdb object alive.\n\
+\n\
+The remaining options set how the file is mapped.  mmap=0 reads\n\
+with pread() instead, for files that outgrow the address space.\n\
+populate faults the whole file in at open (MAP_POPULATE); advice\n\
+is 'normal', 'random' (no readahead, for lookup-only use) or\n\
+'willneed'; hugepages asks for transparent huge pages; and mlock\n\
+pins the map in memory, raising cdb.error if that is refused.\n\
+Options the system lacks are ignored.\n\
+\n\
+If stats is true, the object counts its lookups; see stats()."},
+  {"cdbmake", (PyCFunction)new_cdbmake, METH_VARARGS|METH_KEYWORDS,
+"cdb.cdbmake(cdb, tmp [, cdb64, direct, wordhash, bloom, robinhood,\n\
+  load, spill, expected_records]) -> cdbmake_object\n\
 \n\
 Interface to the creation of a new CDB file \"cdb\".\n\
 \n\
@@ -1009,12 +3331,108 @@ The cdbmake object first writes records to the temporary file\n\
 \"tmp\" (records are inserted via the object's add() method).\n\
 The finish() method then atomically renames \"tmp\" to \"cdb\",\n\
 ensuring that readers of \"cdb\" need never wait for updates to\n\
-complete."
+complete.\n\
+\n\
+If cdb64 is true, the file is written in the 64-bit \"cdb64\"\n\
+layout, which lifts the 4 GiB size limit.  cdb.init() recognizes\n\
+either layout automatically.\n\
+\n\
+If direct is true, records are written with O_DIRECT so that a\n\
+bulk build does not push other data out of the page cache.\n\
+\n\
+If wordhash is true, keys are hashed a word at a time rather than\n\
+with the classic byte-at-a-time cdb hash, which is much faster for\n\
+long keys.  The choice is recorded in the file, and cdb.init()\n\
+follows it; classic cdb tools cannot read such files.\n\
+\n\
+If bloom is nonzero, a blocked Bloom filter of that many bits per\n\
+record (10 gives about 1% false positives) is stored after the\n\
+hash tables.  cdb objects consult it before the tables, answering\n\
+most lookups of absent keys from one cache line.  Classic cdb\n\
+tools read such files as usual and ignore the filter.\n\
+\n\
+If robinhood is true, records are placed in the hash tables with\n\
+Robin Hood displacement, which keeps probe sequences short and\n\
+even.  Any cdb reader can search the result; cdb.init() also\n\
+stops lookups of absent keys early, which the file is marked for.\n\
+\n\
+load sets the share of hash slots that hold records, above 0 and\n\
+below 1, 0.5 by default; every table keeps an empty slot, which\n\
+ends a search for an absent key.  Sparser tables shorten probes at\n\
+the cost of space; the cdbmake object reports what finish()\n\
+achieved.  Files built at other than 0.5 record their table counts\n\
+so len() stays cheap.\n\
+\n\
+If spill names a directory, each record's hash and position go to\n\
+temporary files there, one per hash table, instead of staying in\n\
+memory until finish().  finish() then reads back one table at a\n\
+time, so memory follows the largest table rather than the whole\n\
+file, and the output is the same.\n\
+\n\
+expected_records, if given, is how many records are likely to be\n\
+added; room for them is made up front rather than as they come.\n\
+It is only a hint, and any number of records may be added."
 },
+  {"stack",   (PyCFunction)cdbs_constructor, METH_VARARGS,
+"cdb.stack([newest, ..., base]) -> cdb_stack_object\n\
+\n\
+Read a list of CDBs, cdb objects or anything init() accepts, as one,\n\
+so that small deltas can be layered over a large base instead of\n\
+rebuilding it.  A key is looked up in each layer in turn, newest\n\
+first, hashing it at most once per hash function in use, until a\n\
+layer has a record under it or a tombstone deleting it (see\n\
+cdbmake's delete()).  Iteration yields the merged view: each key\n\
+the stack finds, once."},
+  {"sharded", (PyCFunction)cdbs_sharded, METH_VARARGS|METH_KEYWORDS,
+"cdb.sharded(dir [, zerocopy, mmap, ...]) -> cdb_shards_object\n\
+\n\
+Open the sharded set of CDBs that cdbmake_sharded() built in dir, as\n\
+its manifest lists them, each as init() would with the given keyword\n\
+arguments.  A lookup hashes the key once, in C, and both picks the\n\
+shard and searches it with that hash."},
+  {"cdbmake_sharded", (PyCFunction)new_cdbmake_sharded,
+                      METH_VARARGS|METH_KEYWORDS,
+"cdb.cdbmake_sharded(dir, nshards [, cdb64, wordhash, ...]) -> cdbmake_sharded_object\n\
+\n\
+Build a sharded set of nshards CDBs in the existing directory dir,\n\
+each an ordinary CDB taking the cdbmake() keyword arguments.  A\n\
+record goes to the shard its key's hash picks, computed in C, so\n\
+no shard need hold more than its share; expected_records is split\n\
+among them.  spill costs each shard 256 open files and 16 MB of\n\
+buffers while it is built; a set needing more files than the open\n\
+file limit allows raises cdb.error before any shard is begun.\n\
+\n\
+finish() builds the shards in parallel, then replaces dir/manifest,\n\
+the list of the set's files that sharded() reads, in one rename().\n\
+Shard files are named for the build, so readers of the old set are\n\
+not disturbed, and the files the old manifest listed are removed."},
+  {"analyze", _wrap_cdb_analyze, METH_VARARGS,
+"analyze(f) -> dict\n\
+\n\
+Survey the CDB specified by f, a filename or file descriptor, for\n\
+capacity and layout problems before it ships.  The file is read\n\
+front to back in large pieces rather than mapped, so it may be far\n\
+larger than memory.  The result holds:\n\
+\n\
+  size, records - file size and record count\n\
+  repeats   - records whose key an earlier record already has\n\
+  fill      - records per hash slot, over all tables\n\
+  skew      - records in the fullest table over the mean (1.0 is\n\
+              even; the table is picked by the hash's low byte)\n\
+  bytes     - dict splitting the size into header, lengths (the\n\
+              length pairs in front of records), keys, values,\n\
+              tables and trailer\n\
+  distances - distances[d] records sit d slots past their home\n\
+              slot, so a lookup reads d + 1 slots to find them\n\
+  tables    - 256 dicts of position, slots, records, fill, repeats\n\
+              and distances, one per table\n\
+\n\
+The cdbanalyze script prints this as a report."},
   {"hash",    _wrap_cdb_hash,  METH_VARARGS,
-"hash(s) -> hashval\n\
+"hash(s [, wordhash]) -> hashval\n\
 \n\
-Compute the 32-bit hash value of some sequence of bytes s."},
+Compute the 32-bit hash value of some sequence of bytes s, with the\n\
+word-at-a-time hash of wordhash cdbs if wordhash is true."},
   {NULL,  NULL}
 };
 
@@ -1035,7 +3453,11 @@ initcdb() {
   PyObject *m, *d, *v;
 
   CdbType.ob_type = &PyType_Type;
+  CdbIterType.ob_type = &PyType_Type;
+  CdbStackType.ob_type = &PyType_Type;
+  CdbShardsType.ob_type = &PyType_Type;
   CdbMakeType.ob_type = &PyType_Type;
+  CdbMakeShardedType.ob_type = &PyType_Type;
 
   m = Py_InitModule3("cdb", module_functions, module_doc);
 
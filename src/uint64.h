@@ -0,0 +1,11 @@
+#ifndef UINT64_H
+#define UINT64_H
+
+/* adopted from libowfat 0.9 (GPL) */
+
+typedef unsigned long long uint64;
+
+extern void uint64_pack(char *out,uint64 in);
+extern void uint64_unpack(const char *in,uint64 *out);
+
+#endif
@@ -0,0 +1,10 @@
+#define NO_UINT64_MACROS
+#include "uint32.h"
+#include "uint64.h"
+
+/* adopted from libowfat 0.9 (GPL) */
+
+void uint64_pack(char *out,uint64 in) {
+  uint32_pack(out,in&0xffffffff);
+  uint32_pack(out+4,in>>32);
+}
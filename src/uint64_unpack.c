@@ -0,0 +1,12 @@
+#define NO_UINT64_MACROS
+#include "uint32.h"
+#include "uint64.h"
+
+/* adopted from libowfat 0.9 (GPL) */
+
+void uint64_unpack(const char *in,uint64 *out) {
+  uint32 lo, hi;
+  uint32_unpack(in,&lo);
+  uint32_unpack(in+4,&hi);
+  *out = ((uint64)hi << 32) | lo;
+}
@@ -1,6 +1,11 @@
 #!/usr/bin/env python
 # vim: fileencoding=utf8:et:sw=4:ts=8:sts=4
 
+import os
+import resource
+import signal
+import struct
+import threading
 import unittest
 
 import cdb
@@ -17,6 +22,564 @@ class FailureTestCases(unittest.TestCase):
         self.assertRaises(cdb.error, cm.finish)
 
 
+class FormatTestCases(unittest.TestCase):
+    def test_cdb64_roundtrip(self):
+        cm = cdb.cdbmake('data', 'tmp', cdb64=True)
+        cm.add('flim', 'flam')
+        cm.add('map', 'hash')
+        cm.add('map', 'dictionary')
+        cm.finish()
+
+        c = cdb.init('data')
+        self.assertEqual(c['flim'], 'flam')
+        self.assertEqual(c.getall('map'), ['hash', 'dictionary'])
+        self.assertEqual(c.get('spam'), None)
+        self.assertEqual(len(c), 3)
+        self.assertEqual(c.keys(), ['flim', 'map'])
+        self.assertEqual(c.each(), ('flim', 'flam'))
+
+    def test_threaded_finish(self):
+        pairs = [(str(i), str(i * i)) for i in range(5000)]
+        for threads in (1, 4):
+            cm = cdb.cdbmake('data', 'tmp')
+            cm.addmany(pairs)
+            cm.finish(threads=threads)
+            data = open('data', 'rb').read()
+            if threads == 1:
+                serial = data
+        self.assertEqual(data, serial)
+        self.assertEqual(cdb.init('data')['4999'], str(4999 * 4999))
+
+    def test_bulk_load(self):
+        pairs = [('k%d' % i, 'v' * (i % 7)) for i in range(3000)]
+        pairs.append(('big', 'x' * (3 << 20)))  # spans read blocks
+        cm = cdb.cdbmake('data', 'tmp')
+        cm.addmany(pairs)
+        cm.finish()
+        expected = open('data', 'rb').read()
+
+        cm = cdb.cdbmake('data', 'tmp')
+        cm.addmany(p for p in pairs)
+        cm.finish()
+        self.assertEqual(open('data', 'rb').read(), expected)
+
+        f = open('input', 'wb')
+        for k, v in pairs:
+            f.write('+%d,%d:%s->%s\n' % (len(k), len(v), k, v))
+        f.write('\n')
+        f.close()
+        cm = cdb.cdbmake('data', 'tmp')
+        self.assertEqual(cm.addfile('input'), len(pairs))
+        cm.finish()
+        self.assertEqual(open('data', 'rb').read(), expected)
+
+        cm = cdb.cdbmake('data', 'tmp')
+        self.assertRaises(TypeError, cm.addmany, [('a', 'b'), 'c'])
+        self.assertEqual(cm.numentries, 1)
+        open('input', 'wb').write('+1,1:a->b\n+1,1:c-d\n\n')
+        self.assertRaises(cdb.error, cm.addfile, 'input')
+        open('input', 'wb').write('+1,1:a->b\n')  # no blank line
+        self.assertRaises(cdb.error, cm.addfile, 'input')
+        cm.add('c', 'C')
+        cm.finish()
+        self.assertEqual(cdb.init('data').keys(), ['a', 'c'])
+        self.assertEqual(cdb.init('data').get('c'), 'C')
+
+        # bad input partway through a record leaves the maker unusable
+        for bad in ('+1,4:b->BB', '+1,4:b->BBBBX\n\n'):
+            cm = cdb.cdbmake('data', 'tmp')
+            cm.add('a', 'AAAA')
+            open('input', 'wb').write(bad)
+            self.assertRaises(cdb.error, cm.addfile, 'input')
+            self.assertRaises(cdb.error, cm.add, 'c', 'CCCC')
+            self.assertRaises(cdb.error, cm.finish)
+
+        # and so does a write error there, here past a file size limit
+        open('input', 'wb').write('+1,%d:b->%s\n\n' % (3 << 20, 'B' * (3 << 20)))
+        pid = os.fork()
+        if pid == 0:
+            status = 1
+            try:
+                signal.signal(signal.SIGXFSZ, signal.SIG_IGN)
+                resource.setrlimit(resource.RLIMIT_FSIZE, (1 << 19, 1 << 19))
+                cm = cdb.cdbmake('data', 'tmp')
+                cm.add('a', 'AAAA')
+                try:
+                    cm.addfile('input')
+                except IOError:
+                    try:
+                        cm.add('c', 'CCCC')
+                    except cdb.error:
+                        try:
+                            cm.finish()
+                        except cdb.error:
+                            status = 0
+            finally:
+                os._exit(status)
+        self.assertEqual(os.waitpid(pid, 0)[1], 0)
+        os.unlink('input')
+
+    def test_dump(self):
+        pairs = [('k%d' % i, 'v' * (i % 5)) for i in range(2000)]
+        pairs += [('k7', 'again'), ('big', 'x' * (3 << 20))]
+        text = ''.join('+%d,%d:%s->%s\n' % (len(k), len(v), k, v)
+                       for k, v in pairs) + '\n'
+        for cdb64 in (False, True):
+            cm = cdb.cdbmake('data', 'tmp', cdb64=cdb64)
+            cm.addmany(pairs)
+            cm.finish()
+            w = cdb64 and 8 or 4
+            raw = open('data', 'rb').read()
+            raw = raw[512 * w:struct.unpack('<' + 'IQ'[cdb64], raw[:w])[0]]
+            for mmap in (1, 0):
+                c = cdb.init('data', mmap=mmap)
+                for fmt, expected in ('cdbdump', text), ('raw', raw):
+                    f = open('input', 'w+b')
+                    f.write('#')  # output starts at the current position
+                    c.dump(f, format=fmt)
+                    f.seek(0)
+                    self.assertEqual(f.read(), '#' + expected)
+                    f.close()
+        self.assertRaises(ValueError, c.dump, 1, format='xml')
+
+        c.dump(open('input', 'wb'))
+        cm = cdb.cdbmake('data', 'tmp')
+        self.assertEqual(cm.addfile('input'), len(pairs))
+        cm.finish()
+        os.unlink('input')
+
+    def test_merge(self):
+        old = [('k%d' % i, 'v%d' % i) for i in range(3000)]
+        old += [('k5', 'dup'), ('k2999', 'dup')]
+        gone = set(['k0', 'k5', 'k77', 'k2999', 'absent'])
+        delta = [('k77', 'new'), ('extra', 'x')]
+        kept = [(k, v) for k, v in old if k not in gone]
+
+        def build(pairs, fn='data', **kw):
+            cm = cdb.cdbmake(fn, 'tmp', **kw)
+            cm.addmany(pairs)
+            cm.finish()
+            return open(fn, 'rb').read()
+
+        for oldkw, kw in (({}, {}), ({}, {'bloom': 10, 'robinhood': 1}),
+                          ({'cdb64': 1}, {}), ({}, {'wordhash': 1}),
+                          ({}, {'spill': '.'})):
+            build(old, 'old', **oldkw)
+            expected = build([('first', '1')] + kept + delta, **kw)
+            for mmap in (1, 0):
+                cm = cdb.cdbmake('data', 'tmp', **kw)
+                cm.add('first', '1')
+                n = cm.merge(cdb.init('old', mmap=mmap), delete=iter(gone))
+                self.assertEqual(n, len(kept))
+                cm.addmany(delta)
+                cm.finish()
+                self.assertEqual(open('data', 'rb').read(), expected)
+        self.assertEqual(cdb.init('data').getall('k77'), ['new'])
+        self.assertRaises(TypeError, cm.merge, 'old')
+        os.unlink('old')
+
+    def test_stack(self):
+        cm = cdb.cdbmake('old', 'tmp')
+        cm.addmany([('k%d' % i, 'base%d' % i) for i in range(2000)])
+        cm.addmany([('k3', 'again'), ('k4', 'again')])
+        cm.finish()
+        for kw in ({}, {'wordhash': 1, 'bloom': 10}, {'cdb64': 1}):
+            cm = cdb.cdbmake('data', 'tmp', **kw)
+            cm.addmany([('k3', 'new'), ('extra', 'x'), ('extra', 'y')])
+            for k in ('k4', 'k5', 'k3', 'absent'):
+                cm.delete(k)
+            cm.finish()
+            for mmap in (1, 0):
+                s = cdb.stack([cdb.init('data', mmap=mmap), 'old'])
+                self.assertEqual(s.get('k3'), 'new')
+                self.assertEqual(s.getall('k3'), ['new'])
+                self.assertEqual(s.get('extra', 1), 'y')
+                self.assertEqual(s['k6'], 'base6')
+                self.assertEqual(s.getall('k6'), ['base6'])
+                self.assertEqual(s.get('k4'), None)
+                self.assertFalse(s.has_key('k5'))
+                self.assertTrue('k3' in s)
+                self.assertFalse('k5' in s)
+                self.assertRaises(KeyError, lambda: s['k5'])
+                expected = set('k%d' % i for i in range(2000)) - set(['k4', 'k5'])
+                expected.add('extra')
+                keys = s.keys()
+                self.assertEqual(len(keys), len(expected))
+                self.assertEqual(set(keys), expected)
+                items = dict(s.iteritems())
+                self.assertEqual(len(items), len(expected))
+                self.assertEqual(items['extra'], 'x')
+                self.assertEqual(items['k3'], 'new')
+                self.assertEqual(items['k7'], 'base7')
+        # a lone layer's own records are untouched by its tombstones
+        self.assertEqual(cdb.init('data').get('k3'), 'new')
+        self.assertEqual(cdb.stack(['old']).getall('k3'), ['base3', 'again'])
+        self.assertRaises(ValueError, cdb.stack, [])
+        os.unlink('old')
+
+    def test_sharded(self):
+        d = 'shards'
+        os.mkdir(d)
+        try:
+            pairs = [('k%d' % i, 'v%d' % i) for i in range(3000)]
+            for n, kw in ((1, {}), (7, {}), (4, {'wordhash': 1, 'bloom': 10}),
+                          (3, {'cdb64': 1, 'expected_records': 3000})):
+                cms = cdb.cdbmake_sharded(d, n, **kw)
+                cms.addmany(pairs[:2000])
+                for k, v in pairs[2000:]:
+                    cms.add(k, v)
+                cms.add('k1', 'dup')
+                self.assertEqual(cms.numentries, 3001)
+                cms.finish(threads=2)
+                self.assertRaises(cdb.error, cms.add, 'a', 'b')
+                self.assertEqual(len(os.listdir(d)), n + 1)
+
+                s = cdb.sharded(d, mmap=n % 2)
+                self.assertEqual(len(s), 3001)
+                self.assertEqual(len(s.shards), n)
+                self.assertEqual(s['k5'], 'v5')
+                self.assertEqual(s.getall('k1'), ['v1', 'dup'])
+                self.assertEqual(s.get('k1', 1), 'dup')
+                self.assertEqual(s.get('nope'), None)
+                self.assertFalse(s.has_key('nope'))
+                self.assertTrue('k5' in s)
+                self.assertFalse('nope' in s)
+                self.assertEqual(sorted(s.keys()), sorted(k for k, v in pairs))
+                self.assertEqual(len(list(s.iteritems())), 3001)
+
+                # records sit in the shard the routing hash picks
+                for i, shard in enumerate(s.shards):
+                    for k in shard.keys():
+                        h = cdb.hash(k, kw.get('wordhash', 0))
+                        self.assertEqual(((h * 0x9E3779B1) & 0xffffffff) * n >> 32,
+                                         i)
+            # a failed finish leaves no shard files behind
+            before = sorted(os.listdir(d))
+            cms = cdb.cdbmake_sharded(d, 3)
+            cms.addmany(pairs)
+            build = [f for f in os.listdir(d) if f.endswith('.0001.tmp')][0]
+            blocker = os.path.join(d, build[:-3] + 'cdb')
+            os.mkdir(blocker)
+            self.assertRaises(EnvironmentError, cms.finish)
+            del cms
+            os.rmdir(blocker)
+            self.assertEqual(sorted(os.listdir(d)), before)
+            self.assertEqual(len(cdb.sharded(d)), 3001)
+
+            open(os.path.join(d, 'manifest'), 'w').write('cdb-shards 2\nx\n')
+            self.assertRaises(cdb.error, cdb.sharded, d)
+        finally:
+            for f in os.listdir(d):
+                os.unlink(os.path.join(d, f))
+            os.rmdir(d)
+
+    def test_getmany(self):
+        for cdb64 in (False, True):
+            cm = cdb.cdbmake('data', 'tmp', cdb64=cdb64)
+            cm.addmany([(str(i), 'v' + str(i)) for i in range(1000)])
+            cm.add('7', 'dup')
+            cm.finish()
+
+            c = cdb.init('data')
+            keys = [str(i) for i in range(-50, 1050, 7)]
+            self.assertEqual(c.getmany(keys), [c.get(k) for k in keys])
+            self.assertEqual(c.getmany(('7', 'x')), ['v7', None])
+            self.assertEqual(c.getmany([]), [])
+            self.assertRaises(TypeError, c.getmany, [1])
+
+    def test_shared_between_threads(self):
+        cm = cdb.cdbmake('data', 'tmp')
+        cm.addmany([(str(i), str(-i)) for i in range(2000)])
+        cm.finish()
+
+        c = cdb.init('data')
+        errors = []
+
+        def reader(offset):
+            if len(c.keys()) != 2000:  # races to find the repeats
+                errors.append('keys')
+            for i in range(offset, 2000, 4):
+                if c[str(i)] != str(-i) or not c.has_key(str(i)):
+                    errors.append(i)
+
+        threads = [threading.Thread(target=reader, args=(n,)) for n in range(4)]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        self.assertEqual(errors, [])
+
+    def test_zerocopy(self):
+        cm = cdb.cdbmake('data', 'tmp')
+        cm.add('k', 'x' * 5000)
+        cm.add('k', 'y')
+        cm.finish()
+
+        c = cdb.init('data', zerocopy=True)
+        v = c['k']
+        self.assertTrue(isinstance(v, buffer))
+        self.assertEqual(str(v), 'x' * 5000)
+        self.assertEqual([str(b) for b in c.getall('k')], ['x' * 5000, 'y'])
+        self.assertEqual(c.each()[0], 'k')
+        del c
+        self.assertEqual(v[:3], 'xxx')  # the buffer keeps the map alive
+
+        self.assertTrue(isinstance(cdb.init('data')['k'], str))
+
+    def test_large_values(self):
+        big = 'z' * (3 << 20)  # larger than the output buffer
+        cm = cdb.cdbmake('data', 'tmp')
+        cm.add('small', 's')
+        cm.add('big', big)
+        cm.add('after', 'a')
+        cm.finish()
+
+        c = cdb.init('data')
+        self.assertEqual(c.getmany(['small', 'big', 'after']), ['s', big, 'a'])
+        self.assertEqual(cm.fd, -1)
+
+    def test_wordhash(self):
+        self.assertEqual(cdb.hash('abc'), 193409669)
+        self.assertNotEqual(cdb.hash('abc', 1), cdb.hash('abc'))
+
+        keys = ['k' * n for n in range(40)] + [str(i) for i in range(500)]
+        for cdb64 in (False, True):
+            cm = cdb.cdbmake('data', 'tmp', cdb64=cdb64, wordhash=True)
+            for k in keys:
+                cm.add(k, k[::-1])
+            cm.finish()
+
+            c = cdb.init('data')
+            self.assertEqual([c[k] for k in keys], [k[::-1] for k in keys])
+            self.assertEqual(c.getmany(keys + ['nope']),
+                             [k[::-1] for k in keys] + [None])
+            self.assertEqual(len(c.keys()), len(keys))
+
+    def test_distinct_keys(self):
+        # 'a4gujx5s' and 'u26agrse' share a hash
+        self.assertEqual(cdb.hash('a4gujx5s'), cdb.hash('u26agrse'))
+        recs = [('u26agrse', '1'), ('k', '2'), ('a4gujx5s', '3'),
+                ('u26agrse', '4'), ('a4gujx5s', '5'), ('k', '6')]
+        cm = cdb.cdbmake('data', 'tmp')
+        cm.addmany(recs)
+        cm.finish()
+
+        c = cdb.init('data')
+        self.assertEqual(c.keys(), ['u26agrse', 'k', 'a4gujx5s'])
+        self.assertEqual(c.firstkey(), 'u26agrse')
+        self.assertEqual(c.nextkey(), 'k')
+        self.assertEqual(c.nextkey(), 'a4gujx5s')
+        self.assertEqual(c.nextkey(), None)
+        self.assertEqual(c.getall('a4gujx5s'), ['3', '5'])
+
+    def test_tablecounts(self):
+        cm = cdb.cdbmake('data', 'tmp')
+        cm.addmany([(str(i), '') for i in range(1000)] + [('1', 'again')])
+        cm.finish()
+
+        c = cdb.init('data')
+        counts = c.tablecounts()
+        self.assertEqual(len(counts), 256)
+        self.assertEqual(counts[cdb.hash('1') & 255],
+                         len([i for i in range(1000)
+                              if cdb.hash(str(i)) & 255 == cdb.hash('1') & 255]) + 1)
+        self.assertEqual(sum(counts), 1001)
+        self.assertEqual(len(c), 1001)
+
+    def test_iterators(self):
+        recs = [('a', '1'), ('b', '2'), ('a', '3')]
+        cm = cdb.cdbmake('data', 'tmp')
+        cm.addmany(recs)
+        cm.finish()
+
+        c = cdb.init('data')
+        self.assertEqual(list(c), ['a', 'b'])
+        self.assertEqual(list(c.iterkeys()), ['a', 'b'])
+        self.assertEqual(list(c.itervalues()), ['1', '2', '3'])
+        items = c.iteritems()
+        self.assertEqual(next(items), ('a', '1'))
+        self.assertEqual(list(c.iteritems()), recs)  # independent
+        self.assertEqual(list(items), recs[1:])
+        self.assertTrue('a' in c)
+        self.assertFalse('z' in c)  # a lookup, not a scan
+        self.assertRaises(TypeError, lambda: 1 in c)
+
+    def test_forged_table_size(self):
+        cm = cdb.cdbmake('data', 'tmp', cdb64=True)
+        cm.addmany([('a', '1'), ('b', '2')])
+        cm.finish()
+        f = open('data', 'r+b')
+        f.seek(8)  # slots of table 0: far more than the file could hold
+        f.write(struct.pack('<Q', (1 << 60) + 1))
+        f.close()
+        for mmap in (1, 0):
+            c = cdb.init('data', mmap=mmap)
+            self.assertRaises(cdb.error, c.keys)
+            self.assertRaises(cdb.error, list, c)
+
+    def test_mapping_options(self):
+        cm = cdb.cdbmake('data', 'tmp')
+        for i in xrange(100):
+            cm.add('k%d' % i, 'v%d' % i)
+        cm.finish()
+
+        plain = cdb.init('data', mmap=False)
+        self.assertEqual(plain.size, None)
+        tuned = cdb.init('data', populate=True, advice='random',
+                         hugepages=True)
+        for c in plain, tuned:
+            self.assertEqual(c.warm(), 100 * 2 * 8)  # the tables
+            self.assertEqual(c['k42'], 'v42')
+            self.assertEqual(list(c.iteritems())[-1], ('k99', 'v99'))
+        self.assertRaises(ValueError, cdb.init, 'data', advice='bogus')
+
+    def test_stats(self):
+        cm = cdb.cdbmake('data', 'tmp')
+        cm.addmany([('a4gujx5s', 'x'), ('u26agrse', 'yy'), ('u26agrse', 'z')])
+        cm.finish()
+
+        self.assertEqual(cdb.init('data').stats(), None)
+        c = cdb.init('data', stats=True)
+        self.assertEqual(c.get('u26agrse'), 'yy')  # after a hash collision
+        self.assertEqual(c.getnext(), 'z')
+        self.assertEqual(c.getmany(['a4gujx5s', 'nope']), ['x', None])
+        s = c.stats()
+        self.assertEqual((s['lookups'], s['hits'], s['misses']), (4, 3, 1))
+        self.assertEqual((s['nomatch'], s['bytes']), (1, 4))
+        self.assertEqual(sum(s['probe_lengths']), 4)
+        self.assertEqual(s['probes'], sum(i * n for i, n in
+                                          enumerate(s['probe_lengths'])))
+        c.resetstats()
+        self.assertEqual(c.stats()['lookups'], 0)
+
+    def test_analyze(self):
+        cm = cdb.cdbmake('data', 'tmp')
+        cm.addmany([('a4gujx5s', 'x'), ('u26agrse', 'yy'), ('u26agrse', 'z')])
+        cm.finish()
+
+        a = cdb.analyze('data')
+        self.assertEqual((a['records'], a['repeats']), (3, 1))
+        self.assertEqual(a['bytes'], {'header': 2048, 'lengths': 24,
+                                      'keys': 24, 'values': 4,
+                                      'tables': 48, 'trailer': 0})
+        self.assertEqual(sum(a['bytes'].values()), a['size'])
+        self.assertEqual(sum(a['distances']), 3)
+        self.assertEqual(a['fill'], 0.5)
+        full = [t for t in a['tables'] if t['records']]
+        self.assertEqual(len(full), 1)  # the keys share a hash
+        self.assertEqual((full[0]['slots'], full[0]['repeats']), (6, 1))
+
+    def test_bloom(self):
+        for cdb64 in 0, 1:
+            cm = cdb.cdbmake('data', 'tmp', cdb64=cdb64, bloom=10)
+            for i in xrange(1000):
+                cm.add('k%d' % i, 'v%d' % i)
+            cm.add('k7', 'again')
+            cm.finish()
+
+            for mmap in True, False:
+                c = cdb.init('data', mmap=mmap, stats=True)
+                self.assertEqual(c.getall('k7'), ['v7', 'again'])
+                self.assertEqual(c.getmany(['k%d' % i for i in xrange(1000)]),
+                                 ['v%d' % i for i in xrange(1000)])
+                c.resetstats()
+                misses = ['m%d' % i for i in xrange(1000)]
+                self.assertEqual(c.getmany(misses), [None] * 1000)
+                self.assertEqual([c.get(k) for k in misses], [None] * 1000)
+                # nearly every miss stops at the filter, reading no slots
+                self.assertTrue(c.stats()['probe_lengths'][0] > 1900)
+                self.assertEqual(len(list(c.iteritems())), 1001)
+
+    def test_robinhood(self):
+        recs = [('k%d' % (i % 3000), 'v%d' % i) for i in xrange(4000)]
+        for robinhood in 0, 1:
+            cm = cdb.cdbmake('data', 'tmp', robinhood=robinhood)
+            cm.addmany(recs)
+            cm.finish()
+            a = cdb.analyze('data')
+            c = cdb.init('data', stats=True)
+            for k in 'k0', 'k999', 'k2999':
+                self.assertEqual(c.getall(k), [v for x, v in recs if x == k])
+            c.resetstats()
+            self.assertEqual(c.getmany(['m%d' % i for i in xrange(3000)]),
+                             [None] * 3000)
+            probes = a['distances'], c.stats()['probes']
+            if robinhood:
+                self.assertEqual(sum(probes[0]), sum(plain[0]))
+                self.assertTrue(len(probes[0]) < len(plain[0]))
+                self.assertTrue(probes[1] < plain[1])
+            plain = probes
+
+    def test_load_factor(self):
+        probes = []
+        for load in 0.25, 0.5, 0.9:
+            cm = cdb.cdbmake('data', 'tmp', load=load)
+            self.assertAlmostEqual(cm.load, load, 4)
+            self.assertEqual(cm.hitprobes, None)
+            for i in xrange(10000):
+                cm.add('k%d' % i, 'v')
+            cm.finish()
+            self.assertTrue(load - 0.02 < cm.load <= load)  # rounded per table
+            self.assertTrue(1 <= cm.hitprobes < cm.missprobes)
+            probes.append(cm.missprobes)
+
+            c = cdb.init('data')
+            self.assertEqual(len(c), 10000)
+            self.assertEqual(sum(c.tablecounts()), 10000)
+            self.assertEqual(c['k9999'], 'v')
+            self.assertAlmostEqual(cdb.analyze('data')['fill'], cm.load)
+        self.assertEqual(probes, sorted(probes))
+        self.assertRaises(ValueError, cdb.cdbmake, 'data', 'tmp', load=0)
+        self.assertRaises(ValueError, cdb.cdbmake, 'data', 'tmp', load=1.0)
+        cm = cdb.cdbmake('data', 'tmp', load=0.99999999)
+        cm.addmany(('k%d' % i, 'v') for i in range(100))
+        cm.finish()
+        self.assertTrue(cm.load < 1)
+        c = cdb.init('data')
+        self.assertEqual(c.get('absent'), None)
+
+    def build_repeats(self, **kw):
+        cm = cdb.cdbmake('data', 'tmp', **kw)
+        for i in xrange(5000):
+            cm.add('k%d' % (i % 4000), 'v%d' % i)
+        cm.finish(threads=3)
+        return open('data', 'rb').read()
+
+    def test_spill(self):
+        build = self.build_repeats
+        for kw in {}, {'bloom': 10}, {'robinhood': 1, 'load': 0.8}:
+            self.assertEqual(build(spill='.', **kw), build(**kw))
+        self.assertEqual(cdb.init('data').getall('k1'), ['v1', 'v4001'])
+        self.assertRaises(IOError, cdb.cdbmake, 'data', 'tmp',
+                          spill='/nonexistent')
+        # a sharded build that would run out of files fails up front
+        limits = resource.getrlimit(resource.RLIMIT_NOFILE)
+        before = sorted(os.listdir('.'))
+        resource.setrlimit(resource.RLIMIT_NOFILE, (300, limits[1]))
+        try:
+            self.assertRaises(cdb.error, cdb.cdbmake_sharded, '.', 2,
+                              spill='.')
+        finally:
+            resource.setrlimit(resource.RLIMIT_NOFILE, limits)
+        self.assertEqual(sorted(os.listdir('.')), before)
+
+    def test_expected_records(self):
+        build = self.build_repeats
+        # the hint changes nothing but allocation, even when it is wrong
+        self.assertEqual(build(expected_records=5000), build())
+        self.assertEqual(build(expected_records=10), build())
+        self.assertRaises(ValueError, cdb.cdbmake, 'data', 'tmp',
+                          expected_records=-1)
+
+    def test_classic_layout_unchanged(self):
+        cm = cdb.cdbmake('data', 'tmp')
+        cm.add('a', 'b')
+        cm.finish()
+
+        # 2048 header + 8+1+1 record + 2 slots of 8 bytes, no trailer
+        self.assertEqual(cdb.init('data').size, 2048 + 10 + 16)
+
+
 
 if __name__ == '__main__':
     unittest.main()